@@ -8,6 +8,9 @@ LIBS += -L/usr/local/lib/x86_64-linux-gnu -lwayland-client -lrt -lgbm -ldrm
 INCLUDEPATH += /usr/include/drm
 
 SOURCES += \
+        blend.cpp \
+        display_list.cpp \
+        dmabuf_feedback.cpp \
         linux-dmabuf-unstable-v1.c \
         main.cpp \
         shm.cpp \
@@ -15,6 +18,9 @@ SOURCES += \
         xdg-shell-protocol.c
 
 HEADERS += \
+    blend.h \
+    display_list.h \
+    dmabuf_feedback.h \
     linux-dmabuf-unstable-v1.h \
     shm.h \
     wl_drm.h \
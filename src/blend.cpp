@@ -0,0 +1,187 @@
+#include "blend.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BLEND_X86
+#include <immintrin.h>
+#endif
+
+typedef void (*RowKernel)(uint32_t *dst, int n, uint32_t color);
+
+static RowKernel fillRow = NULL;
+static RowKernel overRow = NULL;
+static BlendIsa selected = BLEND_ISA_SCALAR;
+
+// x * a / 255 rounded, exact for 8 bit x and a
+static inline uint32_t mul255(uint32_t x, uint32_t a)
+{
+    uint32_t t = x * a + 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+static void fill_row_scalar(uint32_t *dst, int n, uint32_t color)
+{
+    for (int i = 0; i < n; i++)
+        dst[i] = color;
+}
+
+static void over_row_scalar(uint32_t *dst, int n, uint32_t color)
+{
+    uint32_t ia = 255 - (color >> 24);
+
+    for (int i = 0; i < n; i++)
+    {
+        uint32_t d = dst[i];
+        uint32_t ag = mul255((d >> 24) & 0xff, ia) << 24 | mul255((d >> 8) & 0xff, ia) << 8;
+        uint32_t rb = mul255((d >> 16) & 0xff, ia) << 16 | mul255(d & 0xff, ia);
+        dst[i] = color + (ag | rb);
+    }
+}
+
+#ifdef BLEND_X86
+
+__attribute__((target("sse4.1")))
+static void fill_row_sse41(uint32_t *dst, int n, uint32_t color)
+{
+    __m128i c = _mm_set1_epi32(color);
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_si128((__m128i*)&dst[i], c);
+
+    for (; i < n; i++)
+        dst[i] = color;
+}
+
+// 16 bit lanes, (t + (t >> 8)) >> 8 with t = x * a + 128 divides by 255
+__attribute__((target("sse4.1")))
+static inline __m128i over_sse41(__m128i d, __m128i ia, __m128i c)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i half = _mm_set1_epi16(128);
+    __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), ia), half);
+    __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), ia), half);
+    lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+    hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+    return _mm_adds_epu8(_mm_packus_epi16(lo, hi), c);
+}
+
+__attribute__((target("sse4.1")))
+static void over_row_sse41(uint32_t *dst, int n, uint32_t color)
+{
+    __m128i c = _mm_set1_epi32(color);
+    __m128i ia = _mm_set1_epi16(255 - (color >> 24));
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_si128((__m128i*)&dst[i], over_sse41(_mm_loadu_si128((__m128i*)&dst[i]), ia, c));
+
+    over_row_scalar(&dst[i], n - i, color);
+}
+
+__attribute__((target("avx2")))
+static void fill_row_avx2(uint32_t *dst, int n, uint32_t color)
+{
+    __m256i c = _mm256_set1_epi32(color);
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8)
+        _mm256_storeu_si256((__m256i*)&dst[i], c);
+
+    for (; i < n; i++)
+        dst[i] = color;
+}
+
+// Unpack and pack both work within 128 bit lanes, so pixel order is kept
+__attribute__((target("avx2")))
+static void over_row_avx2(uint32_t *dst, int n, uint32_t color)
+{
+    __m256i c = _mm256_set1_epi32(color);
+    __m256i ia = _mm256_set1_epi16(255 - (color >> 24));
+    __m256i zero = _mm256_setzero_si256();
+    __m256i half = _mm256_set1_epi16(128);
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i d = _mm256_loadu_si256((__m256i*)&dst[i]);
+        __m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), ia), half);
+        __m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), ia), half);
+        lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+        hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+        _mm256_storeu_si256((__m256i*)&dst[i], _mm256_adds_epu8(_mm256_packus_epi16(lo, hi), c));
+    }
+
+    over_row_scalar(&dst[i], n - i, color);
+}
+
+#endif
+
+void blend_select(BlendIsa isa)
+{
+    fillRow = fill_row_scalar;
+    overRow = over_row_scalar;
+    selected = BLEND_ISA_SCALAR;
+
+#ifdef BLEND_X86
+    __builtin_cpu_init();
+
+    if ((isa == BLEND_ISA_AUTO || isa == BLEND_ISA_AVX2) && __builtin_cpu_supports("avx2"))
+    {
+        fillRow = fill_row_avx2;
+        overRow = over_row_avx2;
+        selected = BLEND_ISA_AVX2;
+    }
+    else if (isa != BLEND_ISA_SCALAR && __builtin_cpu_supports("sse4.1"))
+    {
+        fillRow = fill_row_sse41;
+        overRow = over_row_sse41;
+        selected = BLEND_ISA_SSE41;
+    }
+#else
+    (void)isa;
+#endif
+}
+
+const char *blend_isa_name()
+{
+    switch (selected)
+    {
+    case BLEND_ISA_AVX2:
+        return "avx2";
+    case BLEND_ISA_SSE41:
+        return "sse4.1";
+    default:
+        return "scalar";
+    }
+}
+
+void blend_fill_rect(uint8_t *pixels, uint32_t stride, int x, int y, int w, int h, uint32_t color)
+{
+    if (!fillRow)
+        blend_select(BLEND_ISA_AUTO);
+
+    for (int row = y; row < y + h; row++)
+        fillRow((uint32_t*)&pixels[row * stride] + x, w, color);
+}
+
+void blend_source_over_rect(uint8_t *pixels, uint32_t stride, int x, int y, int w, int h, uint32_t color)
+{
+    if (!overRow)
+        blend_select(BLEND_ISA_AUTO);
+
+    // Opaque colors are a plain fill
+    if ((color >> 24) == 0xff)
+    {
+        blend_fill_rect(pixels, stride, x, y, w, h, color);
+        return;
+    }
+
+    for (int row = y; row < y + h; row++)
+        overRow((uint32_t*)&pixels[row * stride] + x, w, color);
+}
+
+uint32_t blend_premultiply(uint32_t argb)
+{
+    uint32_t a = argb >> 24;
+    return a << 24 | mul255((argb >> 16) & 0xff, a) << 16 | mul255((argb >> 8) & 0xff, a) << 8 | mul255(argb & 0xff, a);
+}
@@ -0,0 +1,29 @@
+#ifndef BLEND_H
+#define BLEND_H
+
+#include <stdint.h>
+
+// Solid rect kernels for 32 bit premultiplied pixels (wl_shm ARGB8888 and XRGB8888)
+
+enum BlendIsa
+{
+    BLEND_ISA_AUTO,     // Best one the CPU supports
+    BLEND_ISA_SCALAR,
+    BLEND_ISA_SSE41,
+    BLEND_ISA_AVX2
+};
+
+// Picks the kernels once, AUTO or an ISA the CPU lacks fall back to the best supported one
+void blend_select(BlendIsa isa);
+const char *blend_isa_name();
+
+// Plain copy of the color into every pixel
+void blend_fill_rect(uint8_t *pixels, uint32_t stride, int x, int y, int w, int h, uint32_t color);
+
+// color + dst * (255 - alpha) / 255 on every channel, color must be premultiplied
+void blend_source_over_rect(uint8_t *pixels, uint32_t stride, int x, int y, int w, int h, uint32_t color);
+
+// Non premultiplied 0xAARRGGBB to premultiplied
+uint32_t blend_premultiply(uint32_t argb);
+
+#endif
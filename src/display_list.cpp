@@ -0,0 +1,246 @@
+#include <stdlib.h>
+
+#include "display_list.h"
+#include "blend.h"
+
+// Every command starts with its op, payloads are packed after it
+struct ColorCommand
+{
+    DisplayListOp op;
+    uint8_t r, g, b, a;
+    bool none;
+};
+
+struct CompositionCommand
+{
+    DisplayListOp op;
+    QPainter::CompositionMode mode;
+};
+
+struct GeometryCommand
+{
+    DisplayListOp op;
+    int32_t a, b, c, d;
+};
+
+// Rounded up so every command stays 8 byte aligned
+static size_t command_size(DisplayListOp op)
+{
+    size_t size = 0;
+
+    switch (op)
+    {
+    case DL_BRUSH:
+    case DL_PEN:
+        size = sizeof(ColorCommand);
+        break;
+    case DL_COMPOSITION:
+        size = sizeof(CompositionCommand);
+        break;
+    case DL_RECT:
+    case DL_LINE:
+        size = sizeof(GeometryCommand);
+        break;
+    }
+
+    return (size + 7) & ~7;
+}
+
+// Bump allocation, commands never span two chunks
+static void *allocate(DisplayList *list, DisplayListOp op)
+{
+    size_t size = command_size(op);
+
+    if (list->chunks.empty() || list->used[list->current] + size > DISPLAY_LIST_CHUNK_SIZE)
+    {
+        if (!list->chunks.empty())
+            list->current++;
+
+        if (list->current == list->chunks.size())
+        {
+            list->chunks.push_back((uint8_t*)malloc(DISPLAY_LIST_CHUNK_SIZE));
+            list->used.push_back(0);
+        }
+    }
+
+    void *command = &list->chunks[list->current][list->used[list->current]];
+    list->used[list->current] += size;
+    list->commands++;
+    *(DisplayListOp*)command = op;
+    return command;
+}
+
+void display_list_reset(DisplayList *list)
+{
+    for (size_t &used : list->used)
+        used = 0;
+
+    list->current = 0;
+    list->commands = 0;
+}
+
+void display_list_free(DisplayList *list)
+{
+    for (uint8_t *chunk : list->chunks)
+        free(chunk);
+
+    list->chunks.clear();
+    list->used.clear();
+    list->current = 0;
+    list->commands = 0;
+}
+
+static void record_color(DisplayList *list, DisplayListOp op, const QColor &color, bool none)
+{
+    ColorCommand *command = (ColorCommand*)allocate(list, op);
+    command->r = color.red();
+    command->g = color.green();
+    command->b = color.blue();
+    command->a = color.alpha();
+    command->none = none;
+}
+
+static void record_geometry(DisplayList *list, DisplayListOp op, int a, int b, int c, int d)
+{
+    GeometryCommand *command = (GeometryCommand*)allocate(list, op);
+    command->a = a;
+    command->b = b;
+    command->c = c;
+    command->d = d;
+}
+
+void display_list_brush(DisplayList *list, const QColor &color)
+{
+    record_color(list, DL_BRUSH, color, false);
+}
+
+void display_list_no_pen(DisplayList *list)
+{
+    record_color(list, DL_PEN, QColor(), true);
+}
+
+void display_list_pen(DisplayList *list, const QColor &color)
+{
+    record_color(list, DL_PEN, color, false);
+}
+
+void display_list_composition(DisplayList *list, QPainter::CompositionMode mode)
+{
+    CompositionCommand *command = (CompositionCommand*)allocate(list, DL_COMPOSITION);
+    command->mode = mode;
+}
+
+void display_list_rect(DisplayList *list, int x, int y, int w, int h)
+{
+    record_geometry(list, DL_RECT, x, y, w, h);
+}
+
+void display_list_line(DisplayList *list, int x1, int y1, int x2, int y2)
+{
+    record_geometry(list, DL_LINE, x1, y1, x2, y2);
+}
+
+size_t display_list_size(const DisplayList *list)
+{
+    size_t size = 0;
+
+    for (size_t i = 0; i <= list->current && i < list->used.size(); i++)
+        size += list->used[i];
+
+    return size;
+}
+
+// Calls func with each command in recording order
+template <typename Func>
+static void for_each_command(const DisplayList *list, Func func)
+{
+    for (size_t chunk = 0; chunk <= list->current && chunk < list->chunks.size(); chunk++)
+    {
+        const uint8_t *command = list->chunks[chunk];
+        const uint8_t *end = command + list->used[chunk];
+
+        while (command < end)
+        {
+            DisplayListOp op = *(const DisplayListOp*)command;
+            func(op, command);
+            command += command_size(op);
+        }
+    }
+}
+
+void display_list_replay(const DisplayList *list, QPainter &painter)
+{
+    for_each_command(list, [&](DisplayListOp op, const uint8_t *data)
+    {
+        switch (op)
+        {
+        case DL_BRUSH:
+        {
+            const ColorCommand *command = (const ColorCommand*)data;
+            painter.setBrush(QColor(command->r, command->g, command->b, command->a));
+            break;
+        }
+        case DL_PEN:
+        {
+            const ColorCommand *command = (const ColorCommand*)data;
+
+            if (command->none)
+                painter.setPen(Qt::NoPen);
+            else
+                painter.setPen(QColor(command->r, command->g, command->b, command->a));
+            break;
+        }
+        case DL_COMPOSITION:
+            painter.setCompositionMode(((const CompositionCommand*)data)->mode);
+            break;
+        case DL_RECT:
+        {
+            const GeometryCommand *command = (const GeometryCommand*)data;
+            painter.drawRect(command->a, command->b, command->c, command->d);
+            break;
+        }
+        case DL_LINE:
+        {
+            const GeometryCommand *command = (const GeometryCommand*)data;
+            painter.drawLine(command->a, command->b, command->c, command->d);
+            break;
+        }
+        }
+    });
+}
+
+void display_list_replay_kernels(const DisplayList *list, uint8_t *pixels, uint32_t stride)
+{
+    uint32_t brush = 0;
+    bool source = false;
+
+    for_each_command(list, [&](DisplayListOp op, const uint8_t *data)
+    {
+        switch (op)
+        {
+        case DL_BRUSH:
+        {
+            const ColorCommand *command = (const ColorCommand*)data;
+            uint32_t argb = (uint32_t)command->a << 24 | command->r << 16 | command->g << 8 | command->b;
+            brush = blend_premultiply(argb);
+            break;
+        }
+        case DL_COMPOSITION:
+            source = ((const CompositionCommand*)data)->mode == QPainter::CompositionMode_Source;
+            break;
+        case DL_RECT:
+        {
+            const GeometryCommand *command = (const GeometryCommand*)data;
+
+            if (source)
+                blend_fill_rect(pixels, stride, command->a, command->b, command->c, command->d, brush);
+            else
+                blend_source_over_rect(pixels, stride, command->a, command->b, command->c, command->d, brush);
+            break;
+        }
+        case DL_PEN:
+        case DL_LINE:
+            break;
+        }
+    });
+}
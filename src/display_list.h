@@ -0,0 +1,49 @@
+#ifndef DISPLAY_LIST_H
+#define DISPLAY_LIST_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#include <QPainter>
+
+// Chunks are kept on reset, so a list recorded every frame stops allocating after the first one
+#define DISPLAY_LIST_CHUNK_SIZE (64 * 1024)
+
+enum DisplayListOp : uint8_t
+{
+    DL_BRUSH,       // Solid brush
+    DL_PEN,         // 1 px solid pen, or Qt::NoPen
+    DL_COMPOSITION, // QPainter::CompositionMode
+    DL_RECT,
+    DL_LINE
+};
+
+struct DisplayList
+{
+    std::vector<uint8_t*> chunks;
+    std::vector<size_t> used;
+    size_t current = 0;
+    size_t commands = 0;
+};
+
+void display_list_reset(DisplayList *list);
+void display_list_free(DisplayList *list);
+
+// Recording, colors are straight 8 bit RGBA like QColor
+void display_list_brush(DisplayList *list, const QColor &color);
+void display_list_no_pen(DisplayList *list);
+void display_list_pen(DisplayList *list, const QColor &color);
+void display_list_composition(DisplayList *list, QPainter::CompositionMode mode);
+void display_list_rect(DisplayList *list, int x, int y, int w, int h);
+void display_list_line(DisplayList *list, int x1, int y1, int x2, int y2);
+
+// Bytes recorded across all chunks
+size_t display_list_size(const DisplayList *list);
+
+void display_list_replay(const DisplayList *list, QPainter &painter);
+
+// Rects only, through the blend kernels on 32 bit premultiplied pixels
+void display_list_replay_kernels(const DisplayList *list, uint8_t *pixels, uint32_t stride);
+
+#endif
@@ -0,0 +1,125 @@
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "dmabuf_feedback.h"
+
+static void feedback_handle_done(void *data, zwp_linux_dmabuf_feedback_v1 *)
+{
+    DmabufFeedback *feedback = (DmabufFeedback*)data;
+    feedback->tranches.swap(feedback->pendingTranches);
+    feedback->pendingTranches.clear();
+    feedback->done = true;
+
+    if (feedback->changed)
+        feedback->changed(feedback);
+}
+
+static void feedback_handle_format_table(void *data, zwp_linux_dmabuf_feedback_v1 *, int32_t fd, uint32_t size)
+{
+    DmabufFeedback *feedback = (DmabufFeedback*)data;
+
+    if (feedback->table)
+        munmap(feedback->table, feedback->tableSize * sizeof(DmabufFormat));
+
+    // The table must be mapped private, the compositor may share the same fd with every client
+    feedback->table = (DmabufFormat*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (feedback->table == MAP_FAILED)
+    {
+        feedback->table = NULL;
+        feedback->tableSize = 0;
+        return;
+    }
+
+    feedback->tableSize = size / sizeof(DmabufFormat);
+}
+
+static void feedback_handle_main_device(void *data, zwp_linux_dmabuf_feedback_v1 *, wl_array *device)
+{
+    DmabufFeedback *feedback = (DmabufFeedback*)data;
+
+    if (device->size == sizeof(dev_t))
+        memcpy(&feedback->mainDevice, device->data, sizeof(dev_t));
+}
+
+static void feedback_handle_tranche_done(void *data, zwp_linux_dmabuf_feedback_v1 *)
+{
+    DmabufFeedback *feedback = (DmabufFeedback*)data;
+    feedback->pendingTranches.push_back(feedback->pendingTranche);
+    feedback->pendingTranche = DmabufTranche();
+}
+
+static void feedback_handle_tranche_target_device(void *data, zwp_linux_dmabuf_feedback_v1 *, wl_array *device)
+{
+    DmabufFeedback *feedback = (DmabufFeedback*)data;
+
+    if (device->size == sizeof(dev_t))
+        memcpy(&feedback->pendingTranche.device, device->data, sizeof(dev_t));
+}
+
+static void feedback_handle_tranche_formats(void *data, zwp_linux_dmabuf_feedback_v1 *, wl_array *indices)
+{
+    DmabufFeedback *feedback = (DmabufFeedback*)data;
+    uint16_t *index;
+
+    wl_array_for_each(index, indices)
+        feedback->pendingTranche.indices.push_back(*index);
+}
+
+static void feedback_handle_tranche_flags(void *data, zwp_linux_dmabuf_feedback_v1 *, uint32_t flags)
+{
+    DmabufFeedback *feedback = (DmabufFeedback*)data;
+    feedback->pendingTranche.flags = flags;
+}
+
+static const zwp_linux_dmabuf_feedback_v1_listener feedback_listener =
+{
+    .done = &feedback_handle_done,
+    .format_table = &feedback_handle_format_table,
+    .main_device = &feedback_handle_main_device,
+    .tranche_done = &feedback_handle_tranche_done,
+    .tranche_target_device = &feedback_handle_tranche_target_device,
+    .tranche_formats = &feedback_handle_tranche_formats,
+    .tranche_flags = &feedback_handle_tranche_flags
+};
+
+DmabufFeedback *dmabuf_feedback_create(zwp_linux_dmabuf_feedback_v1 *feedback, const char *name)
+{
+    DmabufFeedback *result = new DmabufFeedback();
+    result->name = name;
+    result->feedback = feedback;
+    zwp_linux_dmabuf_feedback_v1_add_listener(feedback, &feedback_listener, result);
+    return result;
+}
+
+int dmabuf_feedback_find_tranche(const DmabufFeedback *feedback, uint32_t format, uint64_t modifier)
+{
+    if (!feedback || !feedback->table)
+        return -1;
+
+    for (size_t i = 0; i < feedback->tranches.size(); i++)
+    {
+        for (uint16_t index : feedback->tranches[i].indices)
+        {
+            if (index >= feedback->tableSize)
+                continue;
+
+            const DmabufFormat &entry = feedback->table[index];
+
+            if (entry.format == format && entry.modifier == modifier)
+                return i;
+        }
+    }
+
+    return -1;
+}
+
+bool dmabuf_tranche_is_scanout(const DmabufFeedback *feedback, int tranche)
+{
+    if (!feedback || tranche < 0 || tranche >= (int)feedback->tranches.size())
+        return false;
+
+    return feedback->tranches[tranche].flags & ZWP_LINUX_DMABUF_FEEDBACK_V1_TRANCHE_FLAGS_SCANOUT;
+}
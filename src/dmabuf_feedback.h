@@ -0,0 +1,48 @@
+#ifndef DMABUF_FEEDBACK_H
+#define DMABUF_FEEDBACK_H
+
+#include <sys/types.h>
+#include <vector>
+
+#include "linux-dmabuf-unstable-v1.h"
+
+struct DmabufFormat
+{
+    uint32_t format;
+    uint32_t padding;
+    uint64_t modifier;
+};
+
+struct DmabufTranche
+{
+    dev_t device = 0;
+    uint32_t flags = 0;
+    std::vector<uint16_t> indices;
+};
+
+// Parsed zwp_linux_dmabuf_feedback_v1 state, tranches are in preference order
+struct DmabufFeedback
+{
+    const char *name;
+    zwp_linux_dmabuf_feedback_v1 *feedback = NULL;
+    DmabufFormat *table = NULL;
+    uint32_t tableSize = 0;
+    dev_t mainDevice = 0;
+    std::vector<DmabufTranche> tranches;
+    bool done = false;
+
+    // Called after each done event, the compositor may resend feedback at any time
+    void (*changed)(DmabufFeedback *feedback) = NULL;
+
+    DmabufTranche pendingTranche;
+    std::vector<DmabufTranche> pendingTranches;
+};
+
+DmabufFeedback *dmabuf_feedback_create(zwp_linux_dmabuf_feedback_v1 *feedback, const char *name);
+
+// Index of the first tranche offering the format/modifier pair, -1 if none
+int dmabuf_feedback_find_tranche(const DmabufFeedback *feedback, uint32_t format, uint64_t modifier);
+
+bool dmabuf_tranche_is_scanout(const DmabufFeedback *feedback, int tranche);
+
+#endif
@@ -1,8 +1,12 @@
 #include <fcntl.h>
 #include <wayland-client.h>
-#include <QCoreApplication>
+#include <QGuiApplication>
 #include <QImage>
 #include <QPainter>
+#include <QFont>
+#include <QFontMetrics>
+#include <QTextLayout>
+#include <QGlyphRun>
 
 #include <unistd.h>
 #include <sys/mman.h>
@@ -12,12 +16,33 @@
 #include <drm_fourcc.h>
 #include <linux/dma-buf.h>
 #include <linux/dma-heap.h>
+#include <linux/udmabuf.h>
+#include <sys/sysmacros.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <dirent.h>
+#include <linux/mempolicy.h>
+#include <linux/perf_event.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include "xdg-shell-client-protocol.h"
 #include "linux-dmabuf-unstable-v1.h"
 #include "wl_drm.h"
 
 #include "shm.h"
+#include "blend.h"
+#include "display_list.h"
+#include "dmabuf_feedback.h"
 
 static wl_display *display = NULL;
 
@@ -27,29 +52,62 @@ static wl_compositor *compositor = NULL;
 static xdg_wm_base *wm_base = NULL;
 static zwp_linux_dmabuf_v1 *linux_dmabuf = NULL;
 static wl_drm *drm = NULL;
+static DmabufFeedback *defaultFeedback = NULL;
+static DmabufFeedback *surfaceFeedback = NULL;
 
 // DMA stuff
 static struct DMA
 {
-    int drm;
-    gbm_device *gbm;
+    int drm = -1;
+    gbm_device *gbm = NULL;
     bool argb32Supported = false;
     bool linearModSupported = false;
     bool drmAuthenticated = false;
+    int heap = -1;
+    int udmabuf = -1;
 } dma;
 
 // Buffers
 static int width, height;
 static int bufferScale = 1;
 
+struct PixelFormat
+{
+    const char *option;
+    const char *name;
+    uint32_t shm;
+    uint32_t drm;
+    QImage::Format image;
+    int bpp;
+};
+
+// Same memory layout on both sides, wl_shm and DRM fourccs are little endian
+static const PixelFormat pixelFormats[] =
+{
+    { "argb8888",    "ARGB8888",      WL_SHM_FORMAT_ARGB8888,      DRM_FORMAT_ARGB8888,      QImage::Format_ARGB32,                 4 },
+    { "xrgb8888",    "XRGB8888",      WL_SHM_FORMAT_XRGB8888,      DRM_FORMAT_XRGB8888,      QImage::Format_RGB32,                  4 },
+    { "rgb565",      "RGB565",        WL_SHM_FORMAT_RGB565,        DRM_FORMAT_RGB565,        QImage::Format_RGB16,                  2 },
+    { "argb2101010", "ARGB2101010",   WL_SHM_FORMAT_ARGB2101010,   DRM_FORMAT_ARGB2101010,   QImage::Format_A2RGB30_Premultiplied,  4 },
+    { "fp16",        "ABGR16161616F", WL_SHM_FORMAT_ABGR16161616F, DRM_FORMAT_ABGR16161616F, QImage::Format_RGBA16FPx4,             8 }
+};
+
+static std::vector<uint32_t> shmFormats;
+
+struct ShmPool;
+
 struct Buffer
 {
+    const char *type = "SHM";
+    const PixelFormat *format = &pixelFormats[0];
+    bool dma = false;
+    ShmPool *pool = NULL;
     int i;
     int fd;
     int width;
     int height;
     uint stride;
     int mapSize;
+    int offset = 0;
     uchar *pixels;
     wl_buffer *buffer;
     bool realeased = true;
@@ -57,6 +115,20 @@ struct Buffer
     bool callbacked = true;
 
     bool rendered = false;
+
+    // Render context kept between frames with --render-context=persistent
+    QImage *image = NULL;
+    QPainter *painter = NULL;
+
+    // Cached copy painted instead of the mapping in shadow mode
+    uchar *shadow = NULL;
+
+    // Damage of the next commit in buffer coordinates, empty for the whole buffer
+    std::vector<QRect> damage;
+
+    // Last render() frame drawn into the buffer, -1 if its content is unknown.
+    // Its buffer age is the number of frames rendered since
+    long long paintedFrame = -1;
 };
 
 struct DMABuffer
@@ -64,14 +136,19 @@ struct DMABuffer
     Buffer buffer;
     dma_buf_sync sync;
     gbm_bo *bo = NULL;
+    uint32_t dumbHandle = 0;
+    uint64_t modifier = DRM_FORMAT_MOD_LINEAR;
+    int tranche = -1;
     uchar *map = NULL;
-    void **gbmMap = NULL;
+    void *gbmMap = NULL;
+    Buffer *shmView = NULL;
 };
 
-#define BUFFS 3
+#define MAX_BUFFS 8
 
-static Buffer *shmBuffers[BUFFS];
-static Buffer *dmaBuffers[BUFFS];
+static Buffer *shmBuffers[MAX_BUFFS];
+static Buffer *dmaBuffers[MAX_BUFFS];
+static int buffCount = 0;
 
 // Toplevel
 struct Toplevel
@@ -81,6 +158,9 @@ struct Toplevel
     xdg_toplevel *xdgToplevel = NULL;
     bool pendingCallback = false;
     Buffer **buffers;
+    int depth = 3;
+    int width = 0;
+    int height = 0;
     bool configured = false;
     int i = 0;
     int s = 0;
@@ -88,6 +168,102 @@ struct Toplevel
 
 static Toplevel *toplevel = NULL;
 
+// Options
+enum DMAAllocator
+{
+    DMA_ALLOC_GBM,      // GBM BOs from the render node advertised by wl_drm
+    DMA_ALLOC_HEAP,     // /dev/dma_heap/system, needs neither GBM nor a render node
+    DMA_ALLOC_UDMABUF   // Sealed memfds exported through /dev/udmabuf, also used by the SHM swapchain
+};
+
+static const char *dma_allocator_name(DMAAllocator allocator)
+{
+    switch (allocator)
+    {
+    case DMA_ALLOC_GBM:
+        return "gbm";
+    case DMA_ALLOC_HEAP:
+        return "dma-heap (system)";
+    case DMA_ALLOC_UDMABUF:
+        return "udmabuf";
+    }
+
+    return "unknown";
+}
+
+enum DMACreate
+{
+    DMA_CREATE_ROUNDTRIP,   // create_immed followed by a roundtrip for every buffer
+    DMA_CREATE_BATCH,       // create_immed for every buffer, one roundtrip once all are sent
+    DMA_CREATE_ASYNC        // create with created/failed events, waited for once all are sent
+};
+
+static const char *dma_create_name(DMACreate mode)
+{
+    switch (mode)
+    {
+    case DMA_CREATE_ROUNDTRIP:
+        return "roundtrip";
+    case DMA_CREATE_BATCH:
+        return "batch";
+    case DMA_CREATE_ASYNC:
+        return "async";
+    }
+
+    return "unknown";
+}
+
+enum RenderTarget
+{
+    RENDER_DIRECT,  // Paint straight into the mapped buffer
+    RENDER_SHADOW,  // Paint into a cached copy, then stream the damaged rows to the mapping
+    RENDER_AUTO     // Shadow for buffer types whose mapping reads much slower than cached memory
+};
+
+enum Prefault
+{
+    PREFAULT_OFF,       // Pages are faulted in by the first frame drawn into them
+    PREFAULT_POPULATE,  // MAP_POPULATE on every buffer mmap
+    PREFAULT_TOUCH      // Explicit write to every page after mapping
+};
+
+static struct Options
+{
+    ShmAllocator shmAllocator = SHM_ALLOC_MEMFD;
+    ShmPageSize shmPages = SHM_PAGES_DEFAULT;
+    bool shmSharedPool = true;
+    DMAAllocator dmaAllocator = DMA_ALLOC_GBM;
+    DMACreate dmaCreate = DMA_CREATE_ROUNDTRIP;
+    const char *drmDevice = NULL;
+    int depth = 3;
+    bool depthSweep = false;
+    Prefault prefault = PREFAULT_OFF;
+    bool persistentContext = false;
+    RenderTarget renderTarget = RENDER_DIRECT;
+    int shmStrideAlign = 0;
+    int shmStridePad = 0;
+    bool strideSweep = false;
+    int numaMemory = -1;
+    int numaCpu = -1;
+    bool numaCompare = false;
+    bool followConfigure = false;
+    int renderThreads = 1;
+    bool kernelRenderer = false;
+    bool premultiplied = false;
+    bool batchRects = false;
+    bool displayList = false;
+    double damageFraction = 1.0;
+    bool damageSweep = false;
+    bool repairCopy = false;
+    bool alphaCompare = false;
+    BlendIsa blendIsa = BLEND_ISA_AUTO;
+    bool threadSweep = false;
+    int resizeStormSteps = 0;
+
+    // The swapchain uses the first one, the client only tests run with all of them
+    std::vector<const PixelFormat*> formats;
+} options;
+
 // Measure
 static bool testingDMA = false;
 static bool benchFinished = false;
@@ -96,773 +272,3823 @@ struct timespec renderStart, renderEnd;
 
 static void wl_buffer_handle_release(void *, wl_buffer *buff);
 
-struct wl_buffer_listener buffer_listener =
+static int mmap_flags()
 {
-    .release = &wl_buffer_handle_release
-};
+    return MAP_SHARED | (options.prefault == PREFAULT_POPULATE ? MAP_POPULATE : 0);
+}
 
-static Buffer *create_shm_buffer(int w, int h)
+static void touch_pages(uchar *map, size_t size)
 {
-    Buffer *buffer = new Buffer();
+    // Write back what is read so the content is kept
+    volatile uchar *pages = map;
 
-    buffer->width = w;
-    buffer->height = h;
-    buffer->stride = w * 4;
+    for (size_t i = 0; i < size; i += 4096)
+        pages[i] = pages[i];
+}
+
+static void prefault(uchar *map, size_t size)
+{
+    if (options.prefault == PREFAULT_TOUCH)
+        touch_pages(map, size);
+}
 
-    buffer->mapSize = buffer->stride * h;
+struct wl_buffer_listener buffer_listener =
+{
+    .release = &wl_buffer_handle_release
+};
 
-    buffer->fd = create_shm_file(buffer->stride * buffer->height);
+// Wayland alpha formats are premultiplied, the straight QImage formats make QPainter convert every blended span
+static QImage::Format image_format(const PixelFormat *format)
+{
+    if (!options.premultiplied)
+        return format->image;
 
-    if (buffer->fd < 0)
+    switch (format->image)
     {
-        qFatal() << "Failed to create SHM buffer";
-        exit(EXIT_FAILURE);
+    case QImage::Format_ARGB32:
+        return QImage::Format_ARGB32_Premultiplied;
+    case QImage::Format_RGBA16FPx4:
+        return QImage::Format_RGBA16FPx4_Premultiplied;
+    default:
+        return format->image;
     }
+}
 
-    buffer->pixels = (uint8_t*)mmap(NULL, buffer->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, buffer->fd, 0);
+// SHM rows are aligned then padded as requested, the compositor takes any stride
+static uint shm_stride(int w, const PixelFormat *format)
+{
+    uint stride = w * format->bpp;
 
-    if (buffer->pixels == MAP_FAILED)
-    {
-        qFatal() << "Failed to mmap SHM buffer";
-        close(buffer->fd);
-        exit(EXIT_FAILURE);
-    }
+    if (options.shmStrideAlign)
+        stride = (stride + options.shmStrideAlign - 1) / options.shmStrideAlign * options.shmStrideAlign;
 
-    wl_shm_pool *pool = wl_shm_create_pool(shm, buffer->fd, buffer->mapSize);
-    buffer->buffer = wl_shm_pool_create_buffer(pool, 0, w, h, buffer->stride, WL_SHM_FORMAT_ARGB8888);
-    wl_buffer_set_user_data(buffer->buffer, buffer);
-    wl_buffer_add_listener(buffer->buffer, &buffer_listener, buffer);
-    wl_shm_pool_destroy(pool);
+    return stride + options.shmStridePad;
+}
 
-    return buffer;
+struct MappingProbe
+{
+    std::string type;
+    long long readMBs;
+    long long writeMBs;
+    bool shadow;
+};
+
+static std::vector<MappingProbe> mappingProbes;
+static long long cachedReadMBs = 0;
+static volatile uint64_t probeSink;
+
+static long long probe_read(const uchar *map, size_t size)
+{
+    struct timespec start, end;
+    const uint64_t *words = (const uint64_t*)map;
+    uint64_t sum = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (size_t i = 0; i < size / sizeof(uint64_t); i++)
+        sum += words[i];
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    probeSink = sum;
+    long long elapsed_ns = (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+    return size * 1000LL / std::max(elapsed_ns, 1LL);
 }
 
-static int get_bo_fd(gbm_bo *bo)
+static long long probe_write(uchar *map, size_t size)
 {
-    struct drm_prime_handle prime_handle;
-    memset(&prime_handle, 0, sizeof(prime_handle));
-    prime_handle.handle = gbm_bo_get_handle(bo).u32;
-    prime_handle.flags = DRM_CLOEXEC | DRM_RDWR;
-    prime_handle.fd = -1;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memset(map, 0, size);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long long elapsed_ns = (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+    return size * 1000LL / std::max(elapsed_ns, 1LL);
+}
 
-    if (ioctl(dma.drm, DRM_IOCTL_PRIME_HANDLE_TO_FD, &prime_handle) != 0)
-        goto fail;
+// Classifies the mapping of each buffer type once, uncached and write-combined mappings read far slower than they write
+static const MappingProbe &probe_mapping(Buffer *buffer)
+{
+    for (const MappingProbe &probe : mappingProbes)
+        if (probe.type == buffer->type)
+            return probe;
 
-    if (prime_handle.fd < 0)
-        goto fail;
+    size_t size = std::min<size_t>(buffer->stride * buffer->height, 16 * 1024 * 1024);
 
-    // Set read and write permissions on the file descriptor
-    if (fcntl(prime_handle.fd, F_SETFL, fcntl(prime_handle.fd, F_GETFL) | O_RDWR) == -1)
+    if (!cachedReadMBs)
     {
-        close(prime_handle.fd);
-        goto fail;
+        uchar *reference = (uchar*)malloc(size);
+        memset(reference, 1, size);
+        cachedReadMBs = probe_read(reference, size);
+        free(reference);
     }
 
-    return prime_handle.fd;
+    dma_buf_sync sync;
+
+    if (buffer->dma)
+    {
+        sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_RW;
+        ioctl(buffer->fd, DMA_BUF_IOCTL_SYNC, &sync);
+    }
 
-fail:
+    // Page faults are not part of the mapping cost
+    touch_pages(buffer->pixels, size);
 
-    prime_handle.fd = gbm_bo_get_fd(bo);
+    MappingProbe probe;
+    probe.type = buffer->type;
+    probe.writeMBs = probe_write(buffer->pixels, size);
+    probe.readMBs = probe_read(buffer->pixels, size);
+    probe.shadow = probe.readMBs * 4 < cachedReadMBs;
 
-    if (prime_handle.fd >= 0)
-        return prime_handle.fd;
+    if (buffer->dma)
+    {
+        sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW;
+        ioctl(buffer->fd, DMA_BUF_IOCTL_SYNC, &sync);
+    }
 
-    return -1;
+    qDebug() << "Mapping probe" << buffer->type << ": read" << probe.readMBs << "MB/s, write" << probe.writeMBs << "MB/s, cached read" << cachedReadMBs << "MB/s ->" << (probe.shadow ? "shadow" : "direct");
+    mappingProbes.push_back(probe);
+    return mappingProbes.back();
 }
 
-static Buffer *create_dma_buffer(int w, int h)
+static bool wants_shadow(Buffer *buffer)
 {
-    DMABuffer *buffer = new DMABuffer();
+    if (options.renderTarget == RENDER_AUTO)
+        return probe_mapping(buffer).shadow;
 
-    buffer->buffer.width = w;
-    buffer->buffer.height = h;
+    return options.renderTarget == RENDER_SHADOW;
+}
 
-    buffer->bo = gbm_bo_create(dma.gbm, w, h, WL_DRM_FORMAT_ARGB8888, GBM_BO_USE_LINEAR | GBM_BO_USE_RENDERING);
+static void release_shadow(Buffer *buffer)
+{
+    free(buffer->shadow);
+    buffer->shadow = NULL;
+}
+
+// Copies rows from the shadow to the mapping without pulling the destination into the cache
+static void flush_shadow(Buffer *buffer, int top, int bottom)
+{
+    uchar *dst = &buffer->pixels[top * buffer->stride];
+    const uchar *src = &buffer->shadow[top * buffer->stride];
+    size_t size = (size_t)(bottom - top) * buffer->stride;
 
-    if (!buffer->bo)
+#ifdef __SSE2__
+    if (((uintptr_t)dst & 15) == 0)
     {
-        qFatal() << "Failed to create GBM bo";
-        exit(1);
-    }
+        size_t blocks = size / 16;
 
-    // Get FD
-    buffer->buffer.fd = get_bo_fd(buffer->bo);
+        for (size_t i = 0; i < blocks; i++)
+            _mm_stream_si128((__m128i*)dst + i, _mm_loadu_si128((const __m128i*)src + i));
 
-    if (buffer->buffer.fd == -1)
-    {
-        qFatal() << "Failed to get GBM bo fd";
-        exit(1);
+        memcpy(&dst[blocks * 16], &src[blocks * 16], size - blocks * 16);
+        _mm_sfence();
+        return;
     }
+#endif
 
-    buffer->buffer.stride = gbm_bo_get_stride(buffer->bo);
+    memcpy(dst, src, size);
+}
 
-    buffer->buffer.mapSize = height * buffer->buffer.stride;
+// Must be called before the pixels of a buffer move or go away
+static void release_render_context(Buffer *buffer)
+{
+    if (!buffer->painter)
+        return;
 
-    // Map
-    buffer->map = (uchar*)mmap(NULL, buffer->buffer.mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, buffer->buffer.fd, 0);
+    buffer->painter->end();
+    delete buffer->painter;
+    delete buffer->image;
+    buffer->painter = NULL;
+    buffer->image = NULL;
+}
 
-    if (buffer->map == MAP_FAILED)
+// Memory painted for the buffer, its shadow is created on first use
+static uchar *render_target(Buffer *buffer)
+{
+    if (!buffer->shadow && wants_shadow(buffer))
     {
-        buffer->map = (uchar*)mmap(NULL, buffer->buffer.mapSize, PROT_WRITE, MAP_SHARED,  buffer->buffer.fd, 0);
+        release_render_context(buffer);
+
+        // Same layout as the mapping, starting from its current content
+        size_t size = (buffer->stride * buffer->height + 63) & ~63;
+        buffer->shadow = (uchar*)aligned_alloc(64, size);
+
+        dma_buf_sync sync;
+
+        if (buffer->dma)
+        {
+            sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
+            ioctl(buffer->fd, DMA_BUF_IOCTL_SYNC, &sync);
+        }
+
+        memcpy(buffer->shadow, buffer->pixels, buffer->stride * buffer->height);
 
-        if (buffer->map == MAP_FAILED)
+        if (buffer->dma)
         {
-            buffer->map = (uchar*)gbm_bo_map(buffer->bo, 0, 0, width, height, GBM_BO_TRANSFER_READ, &buffer->buffer.stride, buffer->gbmMap);
+            sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+            ioctl(buffer->fd, DMA_BUF_IOCTL_SYNC, &sync);
         }
     }
 
-    if (buffer->map == NULL || buffer->map == MAP_FAILED)
+    return buffer->shadow ? buffer->shadow : buffer->pixels;
+}
+
+// Frames start from the default painter state whether or not the painter is new
+static QPainter *begin_frame(Buffer *buffer)
+{
+    uchar *target = render_target(buffer);
+
+    if (!buffer->painter)
     {
-        qFatal() << "Failed to map GBM bo";
-        exit(1);
+        buffer->image = new QImage(target, buffer->width, buffer->height, buffer->stride, image_format(buffer->format));
+        buffer->painter = new QPainter(buffer->image);
     }
 
-    buffer->buffer.pixels = &buffer->map[gbm_bo_get_offset(buffer->bo, 0)];
+    buffer->painter->save();
+    return buffer->painter;
+}
 
-    zwp_linux_buffer_params_v1 *params = zwp_linux_dmabuf_v1_create_params(linux_dmabuf);
-    zwp_linux_buffer_params_v1_add(params,
-                                   buffer->buffer.fd,
-                                   0,
-                                   0,
-                                   buffer->buffer.stride,
-                                   DRM_FORMAT_MOD_LINEAR >> 32,
-                                   DRM_FORMAT_MOD_LINEAR & 0xffffffff);
+// Only rows top to bottom were painted
+static void end_frame(Buffer *buffer, int top = 0, int bottom = -1)
+{
+    buffer->painter->restore();
 
-    buffer->buffer.buffer = zwp_linux_buffer_params_v1_create_immed(params, w, h, DRM_FORMAT_ARGB8888, 0);
-    wl_buffer_set_user_data(buffer->buffer.buffer, buffer);
+    if (buffer->shadow)
+        flush_shadow(buffer, top, bottom < 0 ? buffer->height : bottom);
 
-    wl_buffer_add_listener(buffer->buffer.buffer, &buffer_listener, buffer);
+    if (!options.persistentContext)
+        release_render_context(buffer);
+}
 
-    wl_display_roundtrip(display);
+// NUMA placement through raw syscalls, so libnuma is not needed
 
-    return (Buffer*)buffer;
+static std::vector<int> numa_nodes()
+{
+    std::vector<int> nodes;
+    DIR *dir = opendir("/sys/devices/system/node");
+
+    if (!dir)
+        return nodes;
+
+    while (dirent *entry = readdir(dir))
+    {
+        int node;
+
+        if (sscanf(entry->d_name, "node%d", &node) == 1)
+            nodes.push_back(node);
+    }
+
+    closedir(dir);
+    std::sort(nodes.begin(), nodes.end());
+    return nodes;
 }
 
-static void wl_drm_handle_authenticated(void *, wl_drm *)
+static int current_numa_node()
 {
-    dma.drmAuthenticated = true;
-    dma.gbm = gbm_create_device(dma.drm);
+    unsigned cpu = 0, node = 0;
+    syscall(SYS_getcpu, &cpu, &node, NULL);
+    return node;
+}
 
-    if (!dma.gbm)
+// Pages already faulted in are migrated
+static bool bind_memory_to_node(uchar *map, size_t size, int node)
+{
+    if (node < 0)
+        return false;
+
+    // Node numbers come from sysfs and may not fit in one word
+    size_t bits = sizeof(unsigned long) * 8;
+    std::vector<unsigned long> mask(node / bits + 1, 0);
+    mask[node / bits] = 1UL << (node % bits);
+    return syscall(SYS_mbind, map, size, MPOL_BIND, mask.data(), mask.size() * bits, MPOL_MF_MOVE) == 0;
+}
+
+static void bind_shm_memory(uchar *map, size_t size)
+{
+    if (options.numaMemory >= 0 && !bind_memory_to_node(map, size, options.numaMemory))
     {
-        qFatal() << "Failed to create gbm device";
-        exit(1);
+        qFatal() << "Failed to bind SHM memory to NUMA node" << options.numaMemory;
+        exit(EXIT_FAILURE);
     }
+}
 
-    drmVersionPtr version = drmGetVersion(dma.drm);
+static void bind_thread_to_node(int node)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *file = fopen(path, "r");
 
-    if (version)
+    if (!file)
     {
-        qDebug("Driver: %s %s (%d.%d.%d) - %s",
-               version->name,
-               version->desc,
-               version->version_major,
-               version->version_minor,
-               version->version_patchlevel,
-               version->date);
+        qFatal() << "Unknown NUMA node" << node;
+        exit(EXIT_FAILURE);
+    }
 
-        drmFreeVersion(version);
+    // Ranges like 0-7,16-23
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    int first, last;
+
+    while (fscanf(file, "%d", &first) == 1)
+    {
+        last = first;
+
+        if (fscanf(file, "-%d", &last) != 1)
+            last = first;
+
+        for (int cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, &set);
+
+        if (fgetc(file) != ',')
+            break;
     }
-}
 
-static void wl_drm_handle_device(void *, wl_drm *, const char *device)
-{
-    dma.drm = open(device, O_RDWR);
+    fclose(file);
 
-    if (dma.drm < 0)
+    if (sched_setaffinity(0, sizeof(set), &set) != 0)
     {
-        qFatal() << "Failed to open DRM device" << device;
-        exit(1);
+        qFatal() << "Failed to bind the rendering thread to NUMA node" << node;
+        exit(EXIT_FAILURE);
     }
+}
 
-    wl_drm_handle_authenticated(NULL, NULL);
-    return;
+static Buffer *create_shm_buffer(int w, int h, const PixelFormat *format, ShmPageSize pages = SHM_PAGES_DEFAULT, int capacity = 0)
+{
+    Buffer *buffer = new Buffer();
 
-    drm_magic_t magic;
+    if (pages != SHM_PAGES_DEFAULT)
+        buffer->type = "SHM-HUGE";
 
-    int ret = drmGetMagic(dma.drm, &magic);
+    buffer->format = format;
+    buffer->width = w;
+    buffer->height = h;
+    buffer->stride = shm_stride(w, format);
 
-    if (ret == 0)
+    // Huge page backed files must span whole huge pages
+    buffer->mapSize = shm_file_size(std::max<int>(buffer->stride * h, capacity), pages);
+
+    buffer->fd = create_shm_file(buffer->mapSize, options.shmAllocator, pages);
+
+    if (buffer->fd < 0)
     {
-        wl_drm_handle_authenticated(NULL, NULL);
-        return;
+        qFatal() << "Failed to create SHM buffer";
+        exit(EXIT_FAILURE);
     }
-    else if (ret < 0)
+
+    // MAP_POPULATE would fault in 4K pages before MADV_HUGEPAGE applies
+    int flags = pages == SHM_PAGES_THP ? MAP_SHARED : mmap_flags();
+    buffer->pixels = (uint8_t*)mmap(NULL, buffer->mapSize, PROT_READ | PROT_WRITE, flags, buffer->fd, 0);
+
+    if (buffer->pixels == MAP_FAILED)
     {
-        qFatal() << "Failed to get DRM magic";
-        exit(1);
+        qFatal() << "Failed to mmap SHM buffer";
+        close(buffer->fd);
+        exit(EXIT_FAILURE);
     }
 
-    wl_drm_authenticate(drm, magic);
-}
+    bind_shm_memory(buffer->pixels, buffer->mapSize);
 
-static const wl_drm_listener drm_listener
-{
-    .device = &wl_drm_handle_device,
-    .format = [](void*, wl_drm*, uint32_t){},
-    .authenticated = &wl_drm_handle_authenticated,
-    .capabilities = [](void*, wl_drm*, uint32_t){},
-};
+    // Only takes effect if /sys/kernel/mm/transparent_hugepage/shmem_enabled is advise or always.
+    // Must come before any page is faulted in
+    if (pages == SHM_PAGES_THP && madvise(buffer->pixels, buffer->mapSize, MADV_HUGEPAGE) != 0)
+        qWarning() << "MADV_HUGEPAGE failed, SHM-HUGE buffer uses 4K pages";
 
-static void wm_base_handle_ping(void *, xdg_wm_base *wm, uint32_t serial)
-{
-    xdg_wm_base_pong(wm, serial);
+    if (pages == SHM_PAGES_THP && options.prefault == PREFAULT_POPULATE)
+        touch_pages(buffer->pixels, buffer->mapSize);
+    else
+        prefault(buffer->pixels, buffer->mapSize);
+
+    wl_shm_pool *pool = wl_shm_create_pool(shm, buffer->fd, buffer->mapSize);
+    buffer->buffer = wl_shm_pool_create_buffer(pool, 0, w, h, buffer->stride, format->shm);
+    wl_buffer_set_user_data(buffer->buffer, buffer);
+    wl_buffer_add_listener(buffer->buffer, &buffer_listener, buffer);
+    wl_shm_pool_destroy(pool);
+
+    return buffer;
 }
 
-static const struct xdg_wm_base_listener wm_base_listener =
+// A single wl_shm_pool sub-allocated by every buffer of the surface swapchain
+struct ShmPool
 {
-    .ping = &wm_base_handle_ping
+    int fd = -1;
+    int size = 0;
+    int used = 0;
+    uchar *map = NULL;
+    wl_shm_pool *pool = NULL;
+    std::vector<Buffer*> buffers;
+
+    // Offset and size of ranges left by destroyed buffers, sorted and never adjacent
+    std::vector<std::pair<int, int>> freeRanges;
 };
 
-static void handle_global(void *data, wl_registry *registry, uint32_t name, const char *interface, uint32_t version)
+static ShmPool *shmPool = NULL;
+
+static ShmPool *create_shm_pool(int size)
 {
-    (void)data; (void)version;
+    ShmPool *pool = new ShmPool();
+    pool->size = size;
 
-    if (strcmp(interface, wl_shm_interface.name) == 0)
-        shm = (wl_shm*)wl_registry_bind(registry, name, &wl_shm_interface, 1);
-    else if (strcmp(interface, wl_compositor_interface.name) == 0)
-        compositor = (wl_compositor*)wl_registry_bind(registry, name, &wl_compositor_interface, 3);
-    else if (strcmp(interface, xdg_wm_base_interface.name) == 0)
+    // Left growable, the compositor still gets the shrink seal
+    pool->fd = create_shm_file(size, options.shmAllocator, SHM_PAGES_DEFAULT, true);
+
+    if (pool->fd < 0)
     {
-        wm_base = (xdg_wm_base*)wl_registry_bind(registry, name, &xdg_wm_base_interface, 1);
-        xdg_wm_base_add_listener(wm_base, &wm_base_listener, NULL);
+        qFatal() << "Failed to create SHM pool";
+        exit(EXIT_FAILURE);
     }
-    else if (strcmp(interface, zwp_linux_dmabuf_v1_interface.name) == 0)
-        linux_dmabuf = (zwp_linux_dmabuf_v1*)wl_registry_bind(registry, name, &zwp_linux_dmabuf_v1_interface, 3);
-    else if (strcmp(interface, wl_drm_interface.name) == 0)
+
+    pool->map = (uchar*)mmap(NULL, size, PROT_READ | PROT_WRITE, mmap_flags(), pool->fd, 0);
+
+    if (pool->map == MAP_FAILED)
     {
-        drm = (wl_drm*)wl_registry_bind(registry, name, &wl_drm_interface, 1);
-        wl_drm_add_listener(drm, &drm_listener, NULL);
+        qFatal() << "Failed to mmap SHM pool";
+        close(pool->fd);
+        exit(EXIT_FAILURE);
     }
+
+    bind_shm_memory(pool->map, size);
+    prefault(pool->map, size);
+
+    pool->pool = wl_shm_create_pool(shm, pool->fd, size);
+    return pool;
 }
 
-static const wl_registry_listener registry_listener =
+static void shm_pool_grow(ShmPool *pool, int size)
+{
+    if (ftruncate(pool->fd, size) < 0)
+    {
+        qFatal() << "Failed to grow SHM pool";
+        exit(EXIT_FAILURE);
+    }
+
+    uchar *map = (uchar*)mremap(pool->map, pool->size, size, MREMAP_MAYMOVE);
+
+    if (map == MAP_FAILED)
+    {
+        qFatal() << "Failed to remap SHM pool";
+        exit(EXIT_FAILURE);
+    }
+
+    bind_shm_memory(map, size);
+
+    // MAP_POPULATE does not apply to mremap()
+    if (options.prefault != PREFAULT_OFF)
+        touch_pages(&map[pool->size], size - pool->size);
+
+    // The mapping may have moved
+    for (Buffer *buffer : pool->buffers)
+    {
+        release_render_context(buffer);
+        buffer->pixels = &map[buffer->offset];
+    }
+
+    pool->map = map;
+    pool->size = size;
+    wl_shm_pool_resize(pool->pool, size);
+}
+
+// First fit in the freed ranges, then past the last buffer
+static int shm_pool_alloc(ShmPool *pool, int size)
+{
+    for (size_t i = 0; i < pool->freeRanges.size(); i++)
+    {
+        std::pair<int, int> &range = pool->freeRanges[i];
+
+        if (range.second < size)
+            continue;
+
+        int offset = range.first;
+        range.first += size;
+        range.second -= size;
+
+        if (range.second == 0)
+            pool->freeRanges.erase(pool->freeRanges.begin() + i);
+
+        return offset;
+    }
+
+    int offset = pool->used;
+
+    if (offset + size > pool->size)
+        shm_pool_grow(pool, std::max(offset + size, pool->size * 2));
+
+    pool->used = offset + size;
+    return offset;
+}
+
+static void shm_pool_free(ShmPool *pool, int offset, int size)
+{
+    std::vector<std::pair<int, int>> &ranges = pool->freeRanges;
+    auto next = std::lower_bound(ranges.begin(), ranges.end(), std::make_pair(offset, size));
+    next = ranges.insert(next, std::make_pair(offset, size));
+
+    // Merge with the neighbours
+    if (next + 1 != ranges.end() && next->first + next->second == (next + 1)->first)
+    {
+        next->second += (next + 1)->second;
+        ranges.erase(next + 1);
+    }
+
+    if (next != ranges.begin() && (next - 1)->first + (next - 1)->second == next->first)
+    {
+        (next - 1)->second += next->second;
+        next = ranges.erase(next) - 1;
+    }
+
+    // A range at the end goes back to the unused tail
+    if (next->first + next->second == pool->used)
+    {
+        pool->used = next->first;
+        ranges.erase(next);
+    }
+}
+
+static Buffer *create_shm_pool_buffer(ShmPool *pool, int w, int h, const PixelFormat *format, int capacity = 0)
+{
+    Buffer *buffer = new Buffer();
+
+    buffer->pool = pool;
+    buffer->format = format;
+    buffer->width = w;
+    buffer->height = h;
+    buffer->stride = shm_stride(w, format);
+    buffer->fd = pool->fd;
+
+    // Keep every buffer page aligned
+    buffer->mapSize = (std::max<int>(buffer->stride * h, capacity) + 4095) & ~4095;
+    buffer->offset = shm_pool_alloc(pool, buffer->mapSize);
+    buffer->pixels = &pool->map[buffer->offset];
+    buffer->buffer = wl_shm_pool_create_buffer(pool->pool, buffer->offset, w, h, buffer->stride, format->shm);
+    wl_buffer_set_user_data(buffer->buffer, buffer);
+    wl_buffer_add_listener(buffer->buffer, &buffer_listener, buffer);
+    pool->buffers.push_back(buffer);
+
+    return buffer;
+}
+
+static int get_prime_fd(uint32_t handle)
+{
+    struct drm_prime_handle prime_handle;
+    memset(&prime_handle, 0, sizeof(prime_handle));
+    prime_handle.handle = handle;
+    prime_handle.flags = DRM_CLOEXEC | DRM_RDWR;
+    prime_handle.fd = -1;
+
+    if (ioctl(dma.drm, DRM_IOCTL_PRIME_HANDLE_TO_FD, &prime_handle) != 0)
+        return -1;
+
+    if (prime_handle.fd < 0)
+        return -1;
+
+    // Set read and write permissions on the file descriptor
+    if (fcntl(prime_handle.fd, F_SETFL, fcntl(prime_handle.fd, F_GETFL) | O_RDWR) == -1)
+    {
+        close(prime_handle.fd);
+        return -1;
+    }
+
+    return prime_handle.fd;
+}
+
+static int get_bo_fd(gbm_bo *bo)
+{
+    int fd = get_prime_fd(gbm_bo_get_handle(bo).u32);
+
+    if (fd >= 0)
+        return fd;
+
+    fd = gbm_bo_get_fd(bo);
+
+    if (fd >= 0)
+        return fd;
+
+    return -1;
+}
+
+// Fallback for drivers without a GBM backend such as vgem
+static bool create_dumb_bo(DMABuffer *buffer)
+{
+    drm_mode_create_dumb create;
+    memset(&create, 0, sizeof(create));
+    create.width = buffer->buffer.width;
+    create.height = buffer->buffer.height;
+    create.bpp = buffer->buffer.format->bpp * 8;
+
+    if (drmIoctl(dma.drm, DRM_IOCTL_MODE_CREATE_DUMB, &create) != 0)
+        return false;
+
+    buffer->dumbHandle = create.handle;
+    buffer->buffer.stride = create.pitch;
+    buffer->buffer.fd = get_prime_fd(create.handle);
+
+    return buffer->buffer.fd >= 0;
+}
+
+/* CPU mapped buffers are written as linear, so they are always sent with DRM_FORMAT_MOD_LINEAR.
+ * An implicit modifier would let the compositor assume a tiled layout. Feedback only picks the
+ * tranche, preferring the surface feedback, -1 without feedback or if linear is not offered */
+static int choose_cpu_tranche(uint32_t format)
+{
+    DmabufFeedback *feedback = surfaceFeedback && surfaceFeedback->done ? surfaceFeedback : defaultFeedback;
+
+    if (!feedback || !feedback->done)
+        return -1;
+
+    return dmabuf_feedback_find_tranche(feedback, format, DRM_FORMAT_MOD_LINEAR);
+}
+
+static int pendingDMABuffers = 0;
+
+static void params_handle_created(void *data, zwp_linux_buffer_params_v1 *params, wl_buffer *wlBuffer)
+{
+    DMABuffer *buffer = (DMABuffer*)data;
+    zwp_linux_buffer_params_v1_destroy(params);
+    buffer->buffer.buffer = wlBuffer;
+    wl_buffer_set_user_data(buffer->buffer.buffer, buffer);
+    wl_buffer_add_listener(buffer->buffer.buffer, &buffer_listener, buffer);
+    pendingDMABuffers--;
+}
+
+static void params_handle_failed(void *, zwp_linux_buffer_params_v1 *)
+{
+    qFatal() << "The compositor failed to import a DMA buffer";
+    exit(EXIT_FAILURE);
+}
+
+static const zwp_linux_buffer_params_v1_listener params_listener =
+{
+    .created = params_handle_created,
+    .failed = params_handle_failed
+};
+
+// Wraps an already mapped linear dmabuf into a wl_buffer
+static void create_dma_wl_buffer(DMABuffer *buffer)
+{
+    buffer->modifier = DRM_FORMAT_MOD_LINEAR;
+    buffer->tranche = choose_cpu_tranche(buffer->buffer.format->drm);
+
+    zwp_linux_buffer_params_v1 *params = zwp_linux_dmabuf_v1_create_params(linux_dmabuf);
+    zwp_linux_buffer_params_v1_add(params,
+                                   buffer->buffer.fd,
+                                   0,
+                                   0,
+                                   buffer->buffer.stride,
+                                   buffer->modifier >> 32,
+                                   buffer->modifier & 0xffffffff);
+
+    if (options.dmaCreate == DMA_CREATE_ASYNC)
+    {
+        // The wl_buffer arrives with the created event
+        pendingDMABuffers++;
+        zwp_linux_buffer_params_v1_add_listener(params, &params_listener, buffer);
+        zwp_linux_buffer_params_v1_create(params, buffer->buffer.width, buffer->buffer.height, buffer->buffer.format->drm, 0);
+        return;
+    }
+
+    buffer->buffer.buffer = zwp_linux_buffer_params_v1_create_immed(params, buffer->buffer.width, buffer->buffer.height, buffer->buffer.format->drm, 0);
+    zwp_linux_buffer_params_v1_destroy(params);
+    wl_buffer_set_user_data(buffer->buffer.buffer, buffer);
+
+    wl_buffer_add_listener(buffer->buffer.buffer, &buffer_listener, buffer);
+
+    if (options.dmaCreate == DMA_CREATE_ROUNDTRIP)
+        wl_display_roundtrip(display);
+}
+
+// Makes every DMA wl_buffer requested so far usable
+static void wait_dma_buffers()
+{
+    wl_display_roundtrip(display);
+
+    while (pendingDMABuffers > 0 && wl_display_dispatch(display) != -1) {}
+}
+
+static Buffer *create_dma_buffer(int w, int h, const PixelFormat *format)
+{
+    DMABuffer *buffer = new DMABuffer();
+    buffer->buffer.type = "DMA";
+    buffer->buffer.format = format;
+    buffer->buffer.dma = true;
+
+    buffer->buffer.width = w;
+    buffer->buffer.height = h;
+
+    if (dma.gbm)
+        buffer->bo = gbm_bo_create(dma.gbm, w, h, format->drm, GBM_BO_USE_LINEAR | GBM_BO_USE_RENDERING);
+
+    if (buffer->bo)
+    {
+        // Get FD
+        buffer->buffer.fd = get_bo_fd(buffer->bo);
+
+        if (buffer->buffer.fd == -1)
+        {
+            qFatal() << "Failed to get GBM bo fd";
+            exit(1);
+        }
+
+        buffer->buffer.stride = gbm_bo_get_stride(buffer->bo);
+    }
+    else if (create_dumb_bo(buffer))
+    {
+        buffer->buffer.type = "DMA-DUMB";
+    }
+    else
+    {
+        qFatal() << "Failed to create GBM bo or dumb buffer";
+        exit(1);
+    }
+
+    buffer->buffer.mapSize = h * buffer->buffer.stride;
+
+    // Map
+    buffer->map = (uchar*)mmap(NULL, buffer->buffer.mapSize, PROT_READ | PROT_WRITE, mmap_flags(), buffer->buffer.fd, 0);
+
+    if (buffer->map == MAP_FAILED)
+    {
+        buffer->map = (uchar*)mmap(NULL, buffer->buffer.mapSize, PROT_WRITE, mmap_flags(), buffer->buffer.fd, 0);
+
+        if (buffer->map == MAP_FAILED && buffer->bo)
+        {
+            buffer->map = (uchar*)gbm_bo_map(buffer->bo, 0, 0, w, h, GBM_BO_TRANSFER_READ, &buffer->buffer.stride, &buffer->gbmMap);
+        }
+        else if (buffer->map == MAP_FAILED)
+        {
+            drm_mode_map_dumb mapDumb;
+            memset(&mapDumb, 0, sizeof(mapDumb));
+            mapDumb.handle = buffer->dumbHandle;
+
+            if (drmIoctl(dma.drm, DRM_IOCTL_MODE_MAP_DUMB, &mapDumb) == 0)
+                buffer->map = (uchar*)mmap(NULL, buffer->buffer.mapSize, PROT_READ | PROT_WRITE, mmap_flags(), dma.drm, mapDumb.offset);
+        }
+    }
+
+    if (buffer->map == NULL || buffer->map == MAP_FAILED)
+    {
+        qFatal() << "Failed to map GBM bo";
+        exit(1);
+    }
+
+    prefault(buffer->map, buffer->buffer.mapSize);
+
+    buffer->buffer.pixels = buffer->bo ? &buffer->map[gbm_bo_get_offset(buffer->bo, 0)] : buffer->map;
+
+    create_dma_wl_buffer(buffer);
+
+    return (Buffer*)buffer;
+}
+
+static Buffer *create_dmaheap_buffer(int w, int h, const PixelFormat *format)
+{
+    DMABuffer *buffer = new DMABuffer();
+    buffer->buffer.type = "DMA-HEAP";
+    buffer->buffer.format = format;
+    buffer->buffer.dma = true;
+
+    buffer->buffer.width = w;
+    buffer->buffer.height = h;
+    buffer->buffer.stride = w * format->bpp;
+    buffer->buffer.mapSize = h * buffer->buffer.stride;
+
+    dma_heap_allocation_data data;
+    memset(&data, 0, sizeof(data));
+    data.len = buffer->buffer.mapSize;
+    data.fd_flags = O_RDWR | O_CLOEXEC;
+
+    if (ioctl(dma.heap, DMA_HEAP_IOCTL_ALLOC, &data) != 0)
+    {
+        qFatal() << "Failed to allocate DMA heap buffer";
+        exit(1);
+    }
+
+    buffer->buffer.fd = data.fd;
+
+    buffer->map = (uchar*)mmap(NULL, buffer->buffer.mapSize, PROT_READ | PROT_WRITE, mmap_flags(), buffer->buffer.fd, 0);
+
+    if (buffer->map == MAP_FAILED)
+    {
+        qFatal() << "Failed to map DMA heap buffer";
+        exit(1);
+    }
+
+    prefault(buffer->map, buffer->buffer.mapSize);
+
+    buffer->buffer.pixels = buffer->map;
+
+    create_dma_wl_buffer(buffer);
+
+    return (Buffer*)buffer;
+}
+
+/* A sealed memfd exported as a dmabuf. The same mapping also backs a wl_shm
+ * buffer, so both protocol paths can be compared on the same physical memory */
+static Buffer *create_udmabuf_buffer(int w, int h, const PixelFormat *format, Buffer **shmView)
+{
+    DMABuffer *buffer = new DMABuffer();
+    buffer->buffer.type = "UDMABUF-DMA";
+    buffer->buffer.format = format;
+    buffer->buffer.dma = true;
+
+    buffer->buffer.width = w;
+    buffer->buffer.height = h;
+    buffer->buffer.stride = w * format->bpp;
+
+    // udmabuf only accepts whole pages
+    buffer->buffer.mapSize = (h * buffer->buffer.stride + 4095) & ~4095;
+
+    // create_shm_file() adds the F_SEAL_SHRINK seal udmabuf requires
+    int memfd = create_shm_file(buffer->buffer.mapSize, SHM_ALLOC_MEMFD);
+
+    if (memfd < 0)
+    {
+        qFatal() << "Failed to create udmabuf memfd";
+        exit(1);
+    }
+
+    udmabuf_create create;
+    memset(&create, 0, sizeof(create));
+    create.memfd = memfd;
+    create.flags = UDMABUF_FLAGS_CLOEXEC;
+    create.offset = 0;
+    create.size = buffer->buffer.mapSize;
+
+    buffer->buffer.fd = ioctl(dma.udmabuf, UDMABUF_CREATE, &create);
+
+    if (buffer->buffer.fd < 0)
+    {
+        qFatal() << "Failed to create udmabuf";
+        exit(1);
+    }
+
+    buffer->map = (uchar*)mmap(NULL, buffer->buffer.mapSize, PROT_READ | PROT_WRITE, mmap_flags(), memfd, 0);
+
+    if (buffer->map == MAP_FAILED)
+    {
+        qFatal() << "Failed to map udmabuf memfd";
+        exit(1);
+    }
+
+    prefault(buffer->map, buffer->buffer.mapSize);
+
+    buffer->buffer.pixels = buffer->map;
+
+    create_dma_wl_buffer(buffer);
+
+    Buffer *view = new Buffer();
+    view->type = "UDMABUF-SHM";
+    view->format = format;
+    view->width = w;
+    view->height = h;
+    view->stride = buffer->buffer.stride;
+    view->mapSize = buffer->buffer.mapSize;
+    view->fd = memfd;
+    view->pixels = buffer->map;
+
+    wl_shm_pool *pool = wl_shm_create_pool(shm, memfd, view->mapSize);
+    view->buffer = wl_shm_pool_create_buffer(pool, 0, w, h, view->stride, format->shm);
+    wl_buffer_set_user_data(view->buffer, view);
+    wl_buffer_add_listener(view->buffer, &buffer_listener, view);
+    wl_shm_pool_destroy(pool);
+
+    buffer->shmView = view;
+    *shmView = view;
+
+    return (Buffer*)buffer;
+}
+
+// DMA buffer from the selected allocator, udmabuf also returns its SHM view
+static Buffer *create_selected_dma_buffer(int w, int h, const PixelFormat *format, Buffer **shmView)
+{
+    switch (options.dmaAllocator)
+    {
+    case DMA_ALLOC_GBM:
+        return create_dma_buffer(w, h, format);
+    case DMA_ALLOC_HEAP:
+        return create_dmaheap_buffer(w, h, format);
+    case DMA_ALLOC_UDMABUF:
+        return create_udmabuf_buffer(w, h, format, shmView);
+    }
+
+    return NULL;
+}
+
+static Buffer *newestBuffer = NULL;
+
+static void destroy_buffer(Buffer *buffer)
+{
+    if (newestBuffer == buffer)
+        newestBuffer = NULL;
+
+    wl_buffer_destroy(buffer->buffer);
+    release_render_context(buffer);
+    release_shadow(buffer);
+
+    if (buffer->dma)
+    {
+        DMABuffer *dmaBuffer = (DMABuffer*)buffer;
+
+        if (dmaBuffer->gbmMap)
+            gbm_bo_unmap(dmaBuffer->bo, dmaBuffer->gbmMap);
+        else
+            munmap(dmaBuffer->map, buffer->mapSize);
+
+        close(buffer->fd);
+
+        if (dmaBuffer->bo)
+            gbm_bo_destroy(dmaBuffer->bo);
+
+        if (dmaBuffer->dumbHandle)
+        {
+            drm_mode_destroy_dumb destroy;
+            memset(&destroy, 0, sizeof(destroy));
+            destroy.handle = dmaBuffer->dumbHandle;
+            drmIoctl(dma.drm, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+        }
+
+        // The udmabuf SHM view shares the mapping and owns the memfd
+        if (dmaBuffer->shmView)
+        {
+            release_render_context(dmaBuffer->shmView);
+            release_shadow(dmaBuffer->shmView);
+            wl_buffer_destroy(dmaBuffer->shmView->buffer);
+            close(dmaBuffer->shmView->fd);
+            delete dmaBuffer->shmView;
+        }
+
+        delete dmaBuffer;
+        return;
+    }
+
+    if (buffer->pool)
+    {
+        std::vector<Buffer*> &buffers = buffer->pool->buffers;
+        buffers.erase(std::find(buffers.begin(), buffers.end(), buffer));
+        shm_pool_free(buffer->pool, buffer->offset, buffer->mapSize);
+    }
+    else
+    {
+        munmap(buffer->pixels, buffer->mapSize);
+        close(buffer->fd);
+    }
+
+    delete buffer;
+}
+
+/* Swapchain buffers retired by a resize. Exact size matches are reused as they are,
+ * SHM buffers of the same size class are recycled with a new wl_buffer over the same memory */
+struct BufferCache
+{
+    std::vector<Buffer*> buffers;
+    long long bytes = 0;
+    int hits = 0;
+    int recycles = 0;
+    int misses = 0;
+};
+
+static BufferCache shmCache, dmaCache;
+
+// Rounds up to quarter power of two steps so nearby sizes land in the same class
+static int size_class(int bytes)
+{
+    int step = 4096;
+
+    while (step * 8 <= bytes)
+        step *= 2;
+
+    return (bytes + step - 1) / step * step;
+}
+
+static void recycle_shm_buffer(Buffer *buffer, int w, int h)
+{
+    wl_buffer_destroy(buffer->buffer);
+    release_render_context(buffer);
+    release_shadow(buffer);
+
+    buffer->width = w;
+    buffer->height = h;
+    buffer->stride = shm_stride(w, buffer->format);
+    buffer->rendered = false;
+    buffer->paintedFrame = -1;
+
+    wl_shm_pool *pool = buffer->pool ? buffer->pool->pool : wl_shm_create_pool(shm, buffer->fd, buffer->offset + buffer->mapSize);
+    buffer->buffer = wl_shm_pool_create_buffer(pool, buffer->offset, w, h, buffer->stride, buffer->format->shm);
+    wl_buffer_set_user_data(buffer->buffer, buffer);
+    wl_buffer_add_listener(buffer->buffer, &buffer_listener, buffer);
+
+    if (!buffer->pool)
+        wl_shm_pool_destroy(pool);
+}
+
+static Buffer *acquire_buffer(BufferCache *cache, bool isDMA, int w, int h, const PixelFormat *format)
+{
+    int bytes = (isDMA ? w * format->bpp : shm_stride(w, format)) * h;
+    Buffer *recyclable = NULL;
+
+    for (Buffer *buffer : cache->buffers)
+    {
+        // Still held by the compositor
+        if (!buffer->realeased || buffer->format != format)
+            continue;
+
+        if (buffer->width == w && buffer->height == h)
+        {
+            cache->hits++;
+            cache->buffers.erase(std::find(cache->buffers.begin(), cache->buffers.end(), buffer));
+            cache->bytes -= buffer->mapSize;
+            return buffer;
+        }
+
+        // Huge page files are rounded up past the class
+        if (!isDMA && !recyclable && bytes <= buffer->mapSize && buffer->mapSize <= shm_file_size(size_class(bytes), options.shmPages))
+            recyclable = buffer;
+    }
+
+    if (recyclable)
+    {
+        cache->recycles++;
+        cache->buffers.erase(std::find(cache->buffers.begin(), cache->buffers.end(), recyclable));
+        cache->bytes -= recyclable->mapSize;
+        recycle_shm_buffer(recyclable, w, h);
+        return recyclable;
+    }
+
+    cache->misses++;
+
+    if (isDMA)
+    {
+        Buffer *shmView = NULL;
+        return create_selected_dma_buffer(w, h, format, &shmView);
+    }
+
+    // Allocate the whole class so later sizes in it can recycle the buffer
+    if (shmPool)
+        return create_shm_pool_buffer(shmPool, w, h, format, size_class(bytes));
+
+    return create_shm_buffer(w, h, format, options.shmPages, size_class(bytes));
+}
+
+static void retire_buffer(BufferCache *cache, Buffer *buffer)
+{
+    cache->buffers.push_back(buffer);
+    cache->bytes += buffer->mapSize;
+
+    // Evict the oldest released buffers
+    for (size_t i = 0; i < cache->buffers.size() && cache->buffers.size() > 2 * MAX_BUFFS;)
+    {
+        Buffer *old = cache->buffers[i];
+
+        // The frame callback of its last commit still points at it
+        if (!old->realeased || !old->callbacked)
+        {
+            i++;
+            continue;
+        }
+
+        cache->buffers.erase(cache->buffers.begin() + i);
+        cache->bytes -= old->mapSize;
+        destroy_buffer(old);
+    }
+}
+
+// Replaces every buffer of a swapchain with one of the new size
+static BufferCache *resize_swapchain(bool isDMA, int w, int h)
+{
+    // udmabuf SHM buffers are views of the DMA ones and follow them
+    if (options.dmaAllocator == DMA_ALLOC_UDMABUF)
+        isDMA = true;
+
+    Buffer **buffers = isDMA ? dmaBuffers : shmBuffers;
+    BufferCache *cache = isDMA ? &dmaCache : &shmCache;
+
+    for (int i = 0; i < buffCount; i++)
+    {
+        const PixelFormat *format = buffers[i]->format;
+        retire_buffer(cache, buffers[i]);
+        buffers[i] = acquire_buffer(cache, isDMA, w, h, format);
+        buffers[i]->i = i;
+        buffers[i]->commited = true;
+
+        if (options.dmaAllocator == DMA_ALLOC_UDMABUF)
+        {
+            shmBuffers[i] = ((DMABuffer*)buffers[i])->shmView;
+            shmBuffers[i]->i = i;
+            shmBuffers[i]->commited = true;
+        }
+    }
+
+    if (isDMA && options.dmaCreate != DMA_CREATE_ROUNDTRIP)
+        wait_dma_buffers();
+
+    return cache;
+}
+
+static long long swapchain_bytes(Buffer **buffers)
+{
+    long long bytes = 0;
+
+    for (int i = 0; i < buffCount; i++)
+        bytes += buffers[i]->mapSize;
+
+    return bytes;
+}
+
+static void wl_drm_handle_authenticated(void *, wl_drm *)
+{
+    dma.drmAuthenticated = true;
+    dma.gbm = gbm_create_device(dma.drm);
+
+    if (!dma.gbm)
+        qWarning() << "Failed to create gbm device, falling back to dumb buffers";
+
+    drmVersionPtr version = drmGetVersion(dma.drm);
+
+    if (version)
+    {
+        qDebug("Driver: %s %s (%d.%d.%d) - %s",
+               version->name,
+               version->desc,
+               version->version_major,
+               version->version_minor,
+               version->version_patchlevel,
+               version->date);
+
+        drmFreeVersion(version);
+    }
+}
+
+// Returns the first card or render node whose kernel driver is named driver
+static std::string find_drm_device(const char *driver)
+{
+    // Primary nodes first, render nodes do not allow dumb buffer allocation
+    static const struct
+    {
+        const char *format;
+        int first;
+    } nodes[] =
+    {
+        { "/dev/dri/card%d", 0 },
+        { "/dev/dri/renderD%d", 128 }
+    };
+
+    char path[64];
+
+    for (const auto &node : nodes)
+    {
+        for (int i = node.first; i < node.first + 64; i++)
+        {
+            snprintf(path, sizeof(path), node.format, i);
+
+            int fd = open(path, O_RDWR | O_CLOEXEC);
+
+            if (fd < 0)
+                continue;
+
+            drmVersionPtr version = drmGetVersion(fd);
+            bool match = version && strcmp(version->name, driver) == 0;
+
+            if (version)
+                drmFreeVersion(version);
+
+            close(fd);
+
+            if (match)
+                return path;
+        }
+    }
+
+    return std::string();
+}
+
+static void wl_drm_handle_device(void *, wl_drm *, const char *device)
+{
+    dma.drm = open(device, O_RDWR);
+
+    if (dma.drm < 0)
+    {
+        qFatal() << "Failed to open DRM device" << device;
+        exit(1);
+    }
+
+    wl_drm_handle_authenticated(NULL, NULL);
+    return;
+
+    drm_magic_t magic;
+
+    int ret = drmGetMagic(dma.drm, &magic);
+
+    if (ret == 0)
+    {
+        wl_drm_handle_authenticated(NULL, NULL);
+        return;
+    }
+    else if (ret < 0)
+    {
+        qFatal() << "Failed to get DRM magic";
+        exit(1);
+    }
+
+    wl_drm_authenticate(drm, magic);
+}
+
+static const wl_drm_listener drm_listener
+{
+    .device = &wl_drm_handle_device,
+    .format = [](void*, wl_drm*, uint32_t){},
+    .authenticated = &wl_drm_handle_authenticated,
+    .capabilities = [](void*, wl_drm*, uint32_t){},
+};
+
+static void wm_base_handle_ping(void *, xdg_wm_base *wm, uint32_t serial)
+{
+    xdg_wm_base_pong(wm, serial);
+}
+
+static const struct xdg_wm_base_listener wm_base_listener =
+{
+    .ping = &wm_base_handle_ping
+};
+
+static void shm_handle_format(void *, wl_shm *, uint32_t format)
+{
+    shmFormats.push_back(format);
+}
+
+static const wl_shm_listener shm_listener =
+{
+    .format = &shm_handle_format
+};
+
+static void handle_global(void *data, wl_registry *registry, uint32_t name, const char *interface, uint32_t version)
+{
+    (void)data;
+
+    if (strcmp(interface, wl_shm_interface.name) == 0)
+    {
+        shm = (wl_shm*)wl_registry_bind(registry, name, &wl_shm_interface, 1);
+        wl_shm_add_listener(shm, &shm_listener, NULL);
+    }
+    else if (strcmp(interface, wl_compositor_interface.name) == 0)
+        compositor = (wl_compositor*)wl_registry_bind(registry, name, &wl_compositor_interface, std::min(version, 4u));
+    else if (strcmp(interface, xdg_wm_base_interface.name) == 0)
+    {
+        wm_base = (xdg_wm_base*)wl_registry_bind(registry, name, &xdg_wm_base_interface, 1);
+        xdg_wm_base_add_listener(wm_base, &wm_base_listener, NULL);
+    }
+    else if (strcmp(interface, zwp_linux_dmabuf_v1_interface.name) == 0)
+        linux_dmabuf = (zwp_linux_dmabuf_v1*)wl_registry_bind(registry, name, &zwp_linux_dmabuf_v1_interface, std::min(version, 4u));
+    else if (strcmp(interface, wl_drm_interface.name) == 0 && options.dmaAllocator == DMA_ALLOC_GBM && !options.drmDevice)
+    {
+        drm = (wl_drm*)wl_registry_bind(registry, name, &wl_drm_interface, 1);
+        wl_drm_add_listener(drm, &drm_listener, NULL);
+    }
+}
+
+static const wl_registry_listener registry_listener =
 {
     .global = &handle_global,
     .global_remove = NULL
 };
 
-static void xdg_surface_handle_configure(void *data, struct xdg_surface *xdg_surface, uint32_t serial)
+static void xdg_surface_handle_configure(void *data, struct xdg_surface *xdg_surface, uint32_t serial)
+{
+    (void)data;
+    xdg_surface_ack_configure(xdg_surface, serial);
+    toplevel->configured = true;
+}
+
+static const struct xdg_surface_listener xdg_surface_listener =
+{
+    .configure = xdg_surface_handle_configure,
+};
+
+static void xdg_toplevel_handle_configure(void *data, struct xdg_toplevel *xdg_toplevel, int32_t w, int32_t h, struct wl_array *states)
+{
+    (void)data;
+    (void)xdg_toplevel;
+    (void)states;
+
+    // Zero lets the client pick, the swapchains are resized before their next frame
+    if (options.followConfigure && w > 0 && h > 0)
+    {
+        toplevel->width = w * bufferScale;
+        toplevel->height = h * bufferScale;
+    }
+}
+
+static void xdg_toplevel_handle_close(void *data, struct xdg_toplevel *xdg_toplevel)
+{
+    (void)data;
+    (void)xdg_toplevel;
+    exit(1);
+}
+
+static const struct xdg_toplevel_listener xdg_toplevel_listener =
+{
+    .configure = &xdg_toplevel_handle_configure,
+    .close = &xdg_toplevel_handle_close
+};
+
+static void handle_feedback_changed(DmabufFeedback *feedback)
+{
+    qDebug("DMA feedback (%s): %zu tranches, main device %u:%u",
+           feedback->name,
+           feedback->tranches.size(),
+           major(feedback->mainDevice),
+           minor(feedback->mainDevice));
+
+    for (size_t i = 0; i < feedback->tranches.size(); i++)
+    {
+        qDebug("- Tranche %zu: device %u:%u, %zu formats%s",
+               i,
+               major(feedback->tranches[i].device),
+               minor(feedback->tranches[i].device),
+               feedback->tranches[i].indices.size(),
+               dmabuf_tranche_is_scanout(feedback, i) ? ", scanout" : "");
+    }
+
+    // Only surface feedback carries scanout tranches
+    if (feedback != surfaceFeedback)
+        return;
+
+    for (int i = 0; i < MAX_BUFFS && dmaBuffers[i]; i++)
+    {
+        DMABuffer *buffer = (DMABuffer*)dmaBuffers[i];
+        buffer->tranche = dmabuf_feedback_find_tranche(feedback, buffer->buffer.format->drm, buffer->modifier);
+
+        qDebug("- DMA buffer %d (modifier 0x%llx): %s tranche %d%s",
+               i,
+               (unsigned long long)buffer->modifier,
+               buffer->tranche < 0 ? "in no" : "in",
+               buffer->tranche,
+               dmabuf_tranche_is_scanout(feedback, buffer->tranche) ? ", scanout" : "");
+    }
+}
+
+static void createToplevel()
+{
+    toplevel = new Toplevel();
+
+    // Requested size, until a configure with a size of its own arrives
+    toplevel->width = width;
+    toplevel->height = height;
+    toplevel->surface = wl_compositor_create_surface(compositor);
+
+    toplevel->xdgSurface = xdg_wm_base_get_xdg_surface(wm_base, toplevel->surface);
+    xdg_surface_add_listener(toplevel->xdgSurface, &xdg_surface_listener, toplevel);
+
+    toplevel->xdgToplevel = xdg_surface_get_toplevel(toplevel->xdgSurface);
+    xdg_toplevel_add_listener(toplevel->xdgToplevel, &xdg_toplevel_listener, toplevel);
+
+    wl_surface_set_buffer_scale(toplevel->surface, bufferScale);
+    wl_surface_attach(toplevel->surface, NULL, 0, 0);
+    wl_surface_commit(toplevel->surface);
+
+    wl_display_roundtrip(display);
+
+    while (!toplevel->configured)
+        wl_display_roundtrip(display);
+
+    toplevel->buffers = shmBuffers;
+
+    if (zwp_linux_dmabuf_v1_get_version(linux_dmabuf) >= ZWP_LINUX_DMABUF_V1_GET_SURFACE_FEEDBACK_SINCE_VERSION)
+    {
+        surfaceFeedback = dmabuf_feedback_create(zwp_linux_dmabuf_v1_get_surface_feedback(linux_dmabuf, toplevel->surface), "surface");
+        surfaceFeedback->changed = &handle_feedback_changed;
+        wl_display_roundtrip(display);
+    }
+}
+
+static void dmaWriteBegin(DMABuffer *buffer)
+{
+    buffer->sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE;
+    ioctl(buffer->buffer.fd, DMA_BUF_IOCTL_SYNC, &buffer->sync);
+}
+
+static void dmaWriteEnd(DMABuffer *buffer)
+{
+    buffer->sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE;
+    ioctl(buffer->buffer.fd, DMA_BUF_IOCTL_SYNC, &buffer->sync);
+}
+
+static void dmaReadBegin(DMABuffer *buffer)
+{
+    buffer->sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
+    ioctl(buffer->buffer.fd, DMA_BUF_IOCTL_SYNC, &buffer->sync);
+}
+
+static void dmaReadEnd(DMABuffer *buffer)
+{
+    buffer->sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+    ioctl(buffer->buffer.fd, DMA_BUF_IOCTL_SYNC, &buffer->sync);
+}
+
+static long minor_faults()
+{
+    rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return usage.ru_minflt;
+}
+
+// Read misses of one cache of this thread, -1 where perf events are not available
+static int open_cache_miss_counter(uint64_t cache)
+{
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config = cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static int open_l1d_miss_counter()
+{
+    return open_cache_miss_counter(PERF_COUNT_HW_CACHE_L1D);
+}
+
+// Huge pages show up here rather than in wall time alone
+static int open_dtlb_miss_counter()
+{
+    return open_cache_miss_counter(PERF_COUNT_HW_CACHE_DTLB);
+}
+
+static void start_counter(int counter)
+{
+    if (counter < 0)
+        return;
+
+    ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+    ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+// Stops and closes the counter, -1 if it is not available
+static long long finish_counter(int counter)
+{
+    long long count = -1;
+
+    if (counter < 0)
+        return count;
+
+    ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+
+    if (read(counter, &count, sizeof(count)) != sizeof(count))
+        count = -1;
+
+    close(counter);
+    return count;
+}
+
+/* Rects collected per color and submitted with one drawRects() per color.
+ * Only valid for rects that do not overlap, since groups are drawn out of order */
+struct RectBatch
+{
+    std::vector<QColor> colors;
+    std::vector<std::vector<QRect>> groups;
+    std::unordered_map<QRgb, size_t> index;
+};
+
+static void batch_add(RectBatch *batch, const QColor &color, const QRect &rect)
+{
+    auto found = batch->index.find(color.rgba());
+    size_t group;
+
+    if (found != batch->index.end())
+        group = found->second;
+    else
+    {
+        group = batch->colors.size();
+        batch->index[color.rgba()] = group;
+        batch->colors.push_back(color);
+
+        // Rect arrays are kept between frames, only emptied
+        if (batch->groups.size() <= group)
+            batch->groups.emplace_back();
+    }
+
+    batch->groups[group].push_back(rect);
+}
+
+static void batch_submit(RectBatch *batch, QPainter &painter)
+{
+    for (size_t group = 0; group < batch->colors.size(); group++)
+    {
+        painter.setBrush(batch->colors[group]);
+        painter.drawRects(batch->groups[group].data(), batch->groups[group].size());
+        batch->groups[group].clear();
+    }
+
+    batch->colors.clear();
+    batch->index.clear();
+}
+
+// Client only tests
+
+static void drawTest1(Buffer *buffer, int slices)
+{
+    struct timespec start_time, first_time, end_time;
+    long long elapsed_ns, first_ns;
+    long start_faults = minor_faults(), first_faults = 0;
+    int tlbCounter = open_dtlb_miss_counter();
+    start_counter(tlbCounter);
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    // BEGIN
+
+    QPainter &painter = *begin_frame(buffer);
+    const QImage &img = *buffer->image;
+
+    int loops = 10;
+    RectBatch batch;
+
+    QSize squareSize(img.width() / slices, img.height() / slices);
+
+    painter.setPen(Qt::NoPen);
+
+    if (buffer->dma)
+        dmaWriteBegin((DMABuffer*)buffer);
+
+    for (int i = 0; i < loops; i++)
+    {
+        for (int x = 0; x < slices; x++)
+        {
+            for (int y = 0; y < slices; y++)
+            {
+                QRect rect(x * squareSize.width(),
+                           y * squareSize.height(),
+                           squareSize.width(),
+                           squareSize.height());
+
+                if (options.batchRects)
+                    batch_add(&batch, QColor(x, y, x + y), rect);
+                else
+                {
+                    painter.setBrush(QColor(x, y, x + y));
+                    painter.drawRect(rect);
+                }
+            }
+        }
+
+        if (options.batchRects)
+            batch_submit(&batch, painter);
+
+        // The first loop pays for any page not faulted in yet
+        if (i == 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &first_time);
+            first_faults = minor_faults() - start_faults;
+        }
+    }
+    end_frame(buffer);
+
+    if (buffer->dma)
+        dmaWriteEnd((DMABuffer*)buffer);
+
+    // END
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    long steady_faults = minor_faults() - start_faults - first_faults;
+    long long tlb_misses = finish_counter(tlbCounter);
+    elapsed_ns = (end_time.tv_sec - start_time.tv_sec) * 1000000000LL + (end_time.tv_nsec - start_time.tv_nsec);
+    first_ns = (first_time.tv_sec - start_time.tv_sec) * 1000000000LL + (first_time.tv_nsec - start_time.tv_nsec);
+
+    qDebug() << "drawTest1:" << slices * slices << "drawRect() opaque calls of " << squareSize << buffer->type << buffer->format->name << ":" << elapsed_ns / loops << "nanoseconds, first:" << first_ns << "nanoseconds" << first_faults << "faults, steady:" << (elapsed_ns - first_ns) / (loops - 1) << "nanoseconds" << (double)steady_faults / (loops - 1) << "faults per frame, dTLB read misses per frame:" << (tlb_misses < 0 ? -1 : tlb_misses / loops);
+}
+
+static void drawTest2(Buffer *buffer, int slices)
+{
+    struct timespec start_time, first_time, end_time;
+    long long elapsed_ns, first_ns;
+    long start_faults = minor_faults(), first_faults = 0;
+    int tlbCounter = open_dtlb_miss_counter();
+    start_counter(tlbCounter);
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    // BEGIN
+
+    QPainter &painter = *begin_frame(buffer);
+    const QImage &img = *buffer->image;
+
+    int loops = 10;
+    RectBatch batch;
+
+    QSize squareSize(img.width() / slices, img.height() / slices);
+
+    painter.setPen(Qt::NoPen);
+
+    if (buffer->dma)
+        dmaWriteBegin((DMABuffer*)buffer);
+
+    for (int i = 0; i < loops; i++)
+    {
+        for (int x = 0; x < slices; x++)
+        {
+            for (int y = 0; y < slices; y++)
+            {
+                QRect rect(x * squareSize.width(),
+                           y * squareSize.height(),
+                           squareSize.width(),
+                           squareSize.height());
+
+                if (options.batchRects)
+                    batch_add(&batch, QColor(x, y, x + y, 50), rect);
+                else
+                {
+                    painter.setBrush(QColor(x, y, x + y, 50));
+                    painter.drawRect(rect);
+                }
+            }
+        }
+
+        if (options.batchRects)
+            batch_submit(&batch, painter);
+
+        // The first loop pays for any page not faulted in yet
+        if (i == 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &first_time);
+            first_faults = minor_faults() - start_faults;
+        }
+    }
+    end_frame(buffer);
+
+    if (buffer->dma)
+        dmaWriteEnd((DMABuffer*)buffer);
+
+    // END
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    long steady_faults = minor_faults() - start_faults - first_faults;
+    long long tlb_misses = finish_counter(tlbCounter);
+    elapsed_ns = (end_time.tv_sec - start_time.tv_sec) * 1000000000LL + (end_time.tv_nsec - start_time.tv_nsec);
+    first_ns = (first_time.tv_sec - start_time.tv_sec) * 1000000000LL + (first_time.tv_nsec - start_time.tv_nsec);
+
+    qDebug() << "drawTest2:" << slices * slices << "drawRect() translucent calls of " << squareSize << buffer->type << buffer->format->name << ":" << elapsed_ns / loops << "nanoseconds, first:" << first_ns << "nanoseconds" << first_faults << "faults, steady:" << (elapsed_ns - first_ns) / (loops - 1) << "nanoseconds" << (double)steady_faults / (loops - 1) << "faults per frame, dTLB read misses per frame:" << (tlb_misses < 0 ? -1 : tlb_misses / loops);
+}
+
+static void drawTest3(Buffer *buffer)
+{
+    struct timespec start_time, first_time, end_time;
+    long long elapsed_ns, first_ns;
+    long start_faults = minor_faults(), first_faults = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    // BEGIN
+
+    QPainter &painter = *begin_frame(buffer);
+    const QImage &img = *buffer->image;
+
+    int loops = 10;
+    int lines = img.width();
+
+    painter.setBrush(Qt::black);
+
+    int col;
+
+    if (buffer->dma)
+        dmaWriteBegin((DMABuffer*)buffer);
+
+    for (int i = 0; i < loops; i++)
+    {
+        for (int x = 0; x < lines; x++)
+        {
+            col = x % 255;
+            painter.setPen(QColor(col, col, col));
+            painter.drawLine(x, 0, 0, x);
+        }
+
+        // The first loop pays for any page not faulted in yet
+        if (i == 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &first_time);
+            first_faults = minor_faults() - start_faults;
+        }
+    }
+    end_frame(buffer);
+
+    if (buffer->dma)
+        dmaWriteEnd((DMABuffer*)buffer);
+
+    // END
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    elapsed_ns = (end_time.tv_sec - start_time.tv_sec) * 1000000000LL + (end_time.tv_nsec - start_time.tv_nsec);
+    first_ns = (first_time.tv_sec - start_time.tv_sec) * 1000000000LL + (first_time.tv_nsec - start_time.tv_nsec);
+
+    qDebug() << "drawTest3:" << lines << "diagonal drawLine() opaque calls"  << buffer->type << buffer->format->name << ":" << elapsed_ns / loops << "nanoseconds, first:" << first_ns << "nanoseconds" << first_faults << "faults, steady:" << (elapsed_ns - first_ns) / (loops - 1) << "nanoseconds";
+}
+
+static void drawTest4(Buffer *buffer)
+{
+    struct timespec start_time, first_time, end_time;
+    long long elapsed_ns, first_ns;
+    long start_faults = minor_faults(), first_faults = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    // BEGIN
+
+    QPainter &painter = *begin_frame(buffer);
+    const QImage &img = *buffer->image;
+
+    int loops = 10;
+    int lines = img.width();
+
+    painter.setBrush(QColor(50, 50, 50, 50));
+
+    int col;
+
+    if (buffer->dma)
+        dmaWriteBegin((DMABuffer*)buffer);
+
+    for (int i = 0; i < loops; i++)
+    {
+        for (int x = 0; x < lines; x++)
+        {
+            col = x % 255;
+            painter.setPen(QColor(col, col, col, 50));
+            painter.drawLine(x, 0, 0, x);
+        }
+
+        // The first loop pays for any page not faulted in yet
+        if (i == 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &first_time);
+            first_faults = minor_faults() - start_faults;
+        }
+    }
+    end_frame(buffer);
+
+    if (buffer->dma)
+        dmaWriteEnd((DMABuffer*)buffer);
+
+    // END
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    elapsed_ns = (end_time.tv_sec - start_time.tv_sec) * 1000000000LL + (end_time.tv_nsec - start_time.tv_nsec);
+    first_ns = (first_time.tv_sec - start_time.tv_sec) * 1000000000LL + (first_time.tv_nsec - start_time.tv_nsec);
+
+    qDebug() << "drawTest4:" << lines << "diagonal drawLine() translucent calls"  << buffer->type << buffer->format->name << ":" << elapsed_ns / loops << "nanoseconds, first:" << first_ns << "nanoseconds" << first_faults << "faults, steady:" << (elapsed_ns - first_ns) / (loops - 1) << "nanoseconds";
+}
+
+// The blend kernels handle 32 bit formats with 8 bit channels
+static bool kernel_supported(Buffer *buffer)
+{
+    return buffer->format->drm == DRM_FORMAT_ARGB8888 || buffer->format->drm == DRM_FORMAT_XRGB8888;
+}
+
+// drawTest1 and drawTest2 without QPainter, written as premultiplied pixels like wl_shm expects
+static void kernelTest(Buffer *buffer, int slices, bool translucent)
+{
+    struct timespec start_time, first_time, end_time;
+    long long elapsed_ns, first_ns;
+    long start_faults = minor_faults(), first_faults = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    // BEGIN
+
+    int loops = 10;
+
+    QSize squareSize(buffer->width / slices, buffer->height / slices);
+
+    if (buffer->dma)
+        dmaWriteBegin((DMABuffer*)buffer);
+
+    uchar *target = render_target(buffer);
+
+    for (int i = 0; i < loops; i++)
+    {
+        for (int x = 0; x < slices; x++)
+        {
+            for (int y = 0; y < slices; y++)
+            {
+                uint32_t color = blend_premultiply(QColor(x, y, x + y, translucent ? 50 : 255).rgba());
+                blend_source_over_rect(target, buffer->stride,
+                                       x * squareSize.width(),
+                                       y * squareSize.height(),
+                                       squareSize.width(),
+                                       squareSize.height(),
+                                       color);
+            }
+        }
+
+        // The first loop pays for any page not faulted in yet
+        if (i == 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &first_time);
+            first_faults = minor_faults() - start_faults;
+        }
+    }
+
+    if (buffer->shadow)
+        flush_shadow(buffer, 0, buffer->height);
+
+    if (buffer->dma)
+        dmaWriteEnd((DMABuffer*)buffer);
+
+    // END
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    elapsed_ns = (end_time.tv_sec - start_time.tv_sec) * 1000000000LL + (end_time.tv_nsec - start_time.tv_nsec);
+    first_ns = (first_time.tv_sec - start_time.tv_sec) * 1000000000LL + (first_time.tv_nsec - start_time.tv_nsec);
+
+    qDebug() << (translucent ? "kernelTest2:" : "kernelTest1:") << slices * slices << "kernel" << blend_isa_name() << (translucent ? "translucent" : "opaque") << "rects of " << squareSize << buffer->type << buffer->format->name << ":" << elapsed_ns / loops << "nanoseconds, first:" << first_ns << "nanoseconds" << first_faults << "faults, steady:" << (elapsed_ns - first_ns) / (loops - 1) << "nanoseconds";
+}
+
+// Fixed cost of binding a painter to the buffer against frames of tiny rects
+static void drawTest5(Buffer *buffer)
+{
+    struct timespec start_time, end_time;
+    long long setup_ns, frame_ns, persistent_ns;
+    int loops = 100;
+    int slices = 100;
+    QSize squareSize(5, 2);
+
+    if (buffer->dma)
+        dmaWriteBegin((DMABuffer*)buffer);
+
+    // Binding alone
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    for (int i = 0; i < loops; i++)
+    {
+        QImage img = QImage(buffer->pixels, buffer->width, buffer->height, buffer->stride, image_format(buffer->format));
+        QPainter painter(&img);
+        painter.setPen(Qt::NoPen);
+        painter.end();
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    setup_ns = (end_time.tv_sec - start_time.tv_sec) * 1000000000LL + (end_time.tv_nsec - start_time.tv_nsec);
+
+    // New QImage and QPainter every frame
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    for (int i = 0; i < loops; i++)
+    {
+        QImage img = QImage(buffer->pixels, buffer->width, buffer->height, buffer->stride, image_format(buffer->format));
+        QPainter painter(&img);
+        painter.setPen(Qt::NoPen);
+
+        for (int x = 0; x < slices; x++)
+        {
+            for (int y = 0; y < slices; y++)
+            {
+                painter.setBrush(QColor(x, y, x + y));
+                painter.drawRect(x * squareSize.width(), y * squareSize.height(), squareSize.width(), squareSize.height());
+            }
+        }
+
+        painter.end();
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    frame_ns = (end_time.tv_sec - start_time.tv_sec) * 1000000000LL + (end_time.tv_nsec - start_time.tv_nsec);
+
+    // Persistent context, only the painter state is reset
+    QImage *image = new QImage(buffer->pixels, buffer->width, buffer->height, buffer->stride, image_format(buffer->format));
+    QPainter *persistent = new QPainter(image);
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    for (int i = 0; i < loops; i++)
+    {
+        persistent->save();
+        persistent->setPen(Qt::NoPen);
+
+        for (int x = 0; x < slices; x++)
+        {
+            for (int y = 0; y < slices; y++)
+            {
+                persistent->setBrush(QColor(x, y, x + y));
+                persistent->drawRect(x * squareSize.width(), y * squareSize.height(), squareSize.width(), squareSize.height());
+            }
+        }
+
+        persistent->restore();
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    persistent_ns = (end_time.tv_sec - start_time.tv_sec) * 1000000000LL + (end_time.tv_nsec - start_time.tv_nsec);
+    persistent->end();
+    delete persistent;
+    delete image;
+
+    if (buffer->dma)
+        dmaWriteEnd((DMABuffer*)buffer);
+
+    qDebug() << "drawTest5:" << slices * slices << "drawRect() opaque calls of " << squareSize << buffer->type << buffer->format->name << ": setup" << setup_ns / loops << "nanoseconds, new painter:" << frame_ns / loops << "nanoseconds, persistent painter:" << persistent_ns / loops << "nanoseconds, setup share:" << 100.0 * setup_ns / frame_ns << "%";
+}
+
+// Per call state changes against one drawRects() per color, with unique colors and with a small palette
+static void drawTest6(Buffer *buffer, int paletteSize)
+{
+    struct timespec start_time, end_time;
+    long long call_ns, batch_ns;
+    int loops = 10;
+    int slices = 100;
+    RectBatch batch;
+
+    if (buffer->dma)
+        dmaWriteBegin((DMABuffer*)buffer);
+
+    QPainter &painter = *begin_frame(buffer);
+    const QImage &img = *buffer->image;
+    QSize squareSize(img.width() / slices, img.height() / slices);
+    painter.setPen(Qt::NoPen);
+
+    std::vector<QColor> colors;
+
+    for (int x = 0; x < slices; x++)
+    {
+        for (int y = 0; y < slices; y++)
+        {
+            int i = (x * slices + y) % (paletteSize ? paletteSize : slices * slices);
+            colors.push_back(QColor(i % 256, (i / 256) % 256, 100, 50));
+        }
+    }
+
+    for (bool batched : {false, true})
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+        for (int i = 0; i < loops; i++)
+        {
+            for (int x = 0; x < slices; x++)
+            {
+                for (int y = 0; y < slices; y++)
+                {
+                    QRect rect(x * squareSize.width(), y * squareSize.height(), squareSize.width(), squareSize.height());
+
+                    if (batched)
+                        batch_add(&batch, colors[x * slices + y], rect);
+                    else
+                    {
+                        painter.setBrush(colors[x * slices + y]);
+                        painter.drawRect(rect);
+                    }
+                }
+            }
+
+            if (batched)
+                batch_submit(&batch, painter);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end_time);
+        long long elapsed_ns = (end_time.tv_sec - start_time.tv_sec) * 1000000000LL + (end_time.tv_nsec - start_time.tv_nsec);
+        (batched ? batch_ns : call_ns) = elapsed_ns;
+    }
+
+    end_frame(buffer);
+
+    if (buffer->dma)
+        dmaWriteEnd((DMABuffer*)buffer);
+
+    // Grouping reorders draws, which only keeps the output if no two rects overlap
+    QImage outputs[2];
+
+    for (bool batched : {false, true})
+    {
+        QImage &output = outputs[batched];
+        output = QImage(buffer->width, buffer->height, image_format(buffer->format));
+        output.fill(Qt::transparent);
+
+        QPainter outputPainter(&output);
+        outputPainter.setPen(Qt::NoPen);
+
+        for (int x = 0; x < slices; x++)
+        {
+            for (int y = 0; y < slices; y++)
+            {
+                QRect rect(x * squareSize.width(), y * squareSize.height(), squareSize.width(), squareSize.height());
+
+                if (batched)
+                    batch_add(&batch, colors[x * slices + y], rect);
+                else
+                {
+                    outputPainter.setBrush(colors[x * slices + y]);
+                    outputPainter.drawRect(rect);
+                }
+            }
+        }
+
+        if (batched)
+            batch_submit(&batch, outputPainter);
+    }
+
+    bool identical = true;
+
+    for (int y = 0; y < buffer->height && identical; y++)
+        identical = memcmp(outputs[0].constScanLine(y), outputs[1].constScanLine(y), buffer->width * buffer->format->bpp) == 0;
+
+    if (!identical)
+        qWarning() << "drawTest6: drawRects() per color output differs from drawRect() per rect on" << buffer->type << buffer->format->name;
+
+    qDebug() << "drawTest6:" << slices * slices << "translucent rects of " << squareSize << "in" << (paletteSize ? paletteSize : slices * slices) << "colors" << buffer->type << buffer->format->name << ": drawRect() per rect" << call_ns / loops << "nanoseconds, drawRects() per color" << batch_ns / loops << "nanoseconds, output" << (identical ? "identical" : "different");
+}
+
+enum TextMethod
+{
+    TEXT_DRAW_TEXT, // drawText() per line, shaped on every call
+    TEXT_LAYOUT,    // Paragraph wrapped by a QTextLayout, laid out and drawn every frame
+    TEXT_GLYPH_RUN  // Glyph runs of the same paragraph shaped once, only drawn every frame
+};
+
+static const char *text_method_name(TextMethod method)
+{
+    switch (method)
+    {
+    case TEXT_DRAW_TEXT:
+        return "drawText()";
+    case TEXT_LAYOUT:
+        return "QTextLayout";
+    default:
+        return "drawGlyphRun()";
+    }
+}
+
+static const char *textSample = "The quick brown fox jumps over the lazy dog. Pack my box with five dozen liquor jugs. ";
+static int textRuns = 0;
+
+// Lines are added until the buffer is full, returns how many
+static int layout_paragraph(QTextLayout &layout, int width, int height)
+{
+    qreal y = 0;
+    int lines = 0;
+    layout.beginLayout();
+
+    while (y < height)
+    {
+        QTextLine line = layout.createLine();
+
+        if (!line.isValid())
+            break;
+
+        line.setLineWidth(width);
+        line.setPosition(QPointF(0, y));
+        y += line.height();
+        lines++;
+    }
+
+    layout.endLayout();
+    return lines;
+}
+
+/* The first frame rasterizes every glyph into the glyph cache, the next ones only blit them.
+ * A point size nudged per run never matches a cached font engine, so every test starts cold.
+ * The nudge stays under 0.004 pt and only repeats after 4096 runs, more than any option mix makes */
+static void drawTest7(Buffer *buffer, TextMethod method, int pointSize, bool translucent)
+{
+    struct timespec start_time, first_time, end_time;
+    long long elapsed_ns, first_ns;
+    int loops = 10;
+
+    if (buffer->dma)
+        dmaWriteBegin((DMABuffer*)buffer);
+
+    QPainter &painter = *begin_frame(buffer);
+    QFont font(QString::fromLatin1("Sans"));
+    font.setPointSizeF(pointSize + (textRuns++ % 4096) * 0.000001);
+    painter.setFont(font);
+    painter.setPen(QColor(0, 0, 0, translucent ? 128 : 255));
+
+    QFontMetrics metrics(font, buffer->image);
+    int lines = buffer->height / metrics.lineSpacing();
+
+    // Longer than the buffer is wide at every tested size
+    QString line = QString::fromLatin1(textSample).repeated(buffer->width / (pointSize * 20) + 1);
+    QString paragraph = line.repeated(lines);
+
+    // Shaping is done here for glyph runs, outside the timing
+    QTextLayout shaped(paragraph, font, buffer->image);
+    layout_paragraph(shaped, buffer->width, buffer->height);
+    QList<QGlyphRun> runs = shaped.glyphRuns();
+
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    for (int i = 0; i < loops; i++)
+    {
+        if (method == TEXT_DRAW_TEXT)
+        {
+            for (int row = 0; row < lines; row++)
+                painter.drawText(0, row * metrics.lineSpacing() + metrics.ascent(), line);
+        }
+        else if (method == TEXT_LAYOUT)
+        {
+            QTextLayout layout(paragraph, font, buffer->image);
+            lines = layout_paragraph(layout, buffer->width, buffer->height);
+            layout.draw(&painter, QPointF(0, 0));
+        }
+        else
+        {
+            for (const QGlyphRun &run : runs)
+                painter.drawGlyphRun(QPointF(0, 0), run);
+        }
+
+        if (i == 0)
+            clock_gettime(CLOCK_MONOTONIC, &first_time);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    end_frame(buffer);
+
+    if (buffer->dma)
+        dmaWriteEnd((DMABuffer*)buffer);
+
+    elapsed_ns = (end_time.tv_sec - start_time.tv_sec) * 1000000000LL + (end_time.tv_nsec - start_time.tv_nsec);
+    first_ns = (first_time.tv_sec - start_time.tv_sec) * 1000000000LL + (first_time.tv_nsec - start_time.tv_nsec);
+    long long warm_ns = (elapsed_ns - first_ns) / (loops - 1);
+
+    qDebug() << "drawTest7:" << lines << "lines of" << pointSize << "pt" << (translucent ? "translucent" : "opaque") << "text with" << text_method_name(method) << buffer->type << buffer->format->name << ": cold cache" << first_ns << "nanoseconds, warm cache" << warm_ns << "nanoseconds, glyph rasterization" << first_ns - warm_ns << "nanoseconds";
+}
+
+enum BlitMode
+{
+    BLIT_COPY,         // 1:1
+    BLIT_SCALE_2X,     // Integer scale
+    BLIT_SCALE_FAST,   // 1.5x, nearest neighbour
+    BLIT_SCALE_SMOOTH, // 1.5x with SmoothPixmapTransform
+    BLIT_ROTATE        // 30 degrees with SmoothPixmapTransform
+};
+
+static const char *blit_mode_name(BlitMode mode)
+{
+    switch (mode)
+    {
+    case BLIT_COPY:
+        return "1:1";
+    case BLIT_SCALE_2X:
+        return "2x scaled";
+    case BLIT_SCALE_FAST:
+        return "1.5x scaled";
+    case BLIT_SCALE_SMOOTH:
+        return "1.5x smooth scaled";
+    default:
+        return "rotated";
+    }
+}
+
+// Thumbnail sized gradient, alpha sources fade out from left to right
+static QImage blit_source(bool alpha)
+{
+    QImage image(256, 256, alpha ? QImage::Format_ARGB32_Premultiplied : QImage::Format_RGB32);
+
+    for (int y = 0; y < image.height(); y++)
+    {
+        uint32_t *row = (uint32_t*)image.scanLine(y);
+
+        for (int x = 0; x < image.width(); x++)
+        {
+            uint32_t a = alpha ? 255 - x : 255;
+            row[x] = blend_premultiply(a << 24 | x << 16 | y << 8 | (x + y) / 2);
+        }
+    }
+
+    return image;
+}
+
+// Tiles the buffer with drawImage() of one source, like icon grids and thumbnail views
+static void drawTest8(Buffer *buffer, BlitMode mode, bool alpha)
+{
+    struct timespec start_time, end_time;
+    long long elapsed_ns;
+    int loops = 10;
+    int blits = 0;
+    long long pixels = 0;
+
+    QImage source = blit_source(alpha);
+    double scale = mode == BLIT_SCALE_2X ? 2.0 : (mode == BLIT_SCALE_FAST || mode == BLIT_SCALE_SMOOTH) ? 1.5 : 1.0;
+    int tile = source.width() * scale;
+
+    if (buffer->dma)
+        dmaWriteBegin((DMABuffer*)buffer);
+
+    QPainter &painter = *begin_frame(buffer);
+    painter.setRenderHint(QPainter::SmoothPixmapTransform, mode == BLIT_SCALE_SMOOTH || mode == BLIT_ROTATE);
+
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    for (int i = 0; i < loops; i++)
+    {
+        for (int y = 0; y < buffer->height; y += tile)
+        {
+            for (int x = 0; x < buffer->width; x += tile)
+            {
+                if (mode == BLIT_COPY)
+                    painter.drawImage(QPoint(x, y), source);
+                else if (mode == BLIT_ROTATE)
+                {
+                    painter.save();
+                    painter.translate(x + tile / 2.0, y + tile / 2.0);
+                    painter.rotate(30);
+                    painter.drawImage(QPointF(-tile / 2.0, -tile / 2.0), source);
+                    painter.restore();
+                }
+                else
+                    painter.drawImage(QRectF(x, y, tile, tile), source);
+
+                // Tiles on the right and bottom edges are clipped
+                if (i == 0)
+                {
+                    QRect drawn = QRect(x, y, tile, tile).intersected(QRect(0, 0, buffer->width, buffer->height));
+                    pixels += (long long)drawn.width() * drawn.height();
+                    blits++;
+                }
+            }
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    end_frame(buffer);
+
+    if (buffer->dma)
+        dmaWriteEnd((DMABuffer*)buffer);
+
+    elapsed_ns = (end_time.tv_sec - start_time.tv_sec) * 1000000000LL + (end_time.tv_nsec - start_time.tv_nsec);
+
+    qDebug() << "drawTest8:" << blits << blit_mode_name(mode) << (alpha ? "alpha" : "opaque") << "blits of" << source.size() << "to" << tile << "px" << buffer->type << buffer->format->name << ":" << elapsed_ns / loops << "nanoseconds," << pixels * 1000.0 / (elapsed_ns / loops) << "Mpixels/s";
+}
+
+// Translucent fills over whole rows and over narrow columns, which hit the same cache sets on every row when the stride is a large power of two
+static void strideTest(int w, int h, const PixelFormat *format, const char *label)
+{
+    Buffer *buffer = create_shm_buffer(w, h, format);
+    touch_pages(buffer->pixels, buffer->mapSize);
+
+    QImage img = QImage(buffer->pixels, buffer->width, buffer->height, buffer->stride, image_format(buffer->format));
+    QPainter painter(&img);
+    painter.setPen(Qt::NoPen);
+    painter.setBrush(QColor(50, 100, 150, 50));
+
+    struct timespec start_time, end_time;
+    int loops = 10;
+    int columns = 64;
+    int columnWidth = 4;
+
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    for (int i = 0; i < loops; i++)
+        painter.drawRect(0, 0, w, h);
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    long long rows_ns = (end_time.tv_sec - start_time.tv_sec) * 1000000000LL + (end_time.tv_nsec - start_time.tv_nsec);
+
+    int counter = open_l1d_miss_counter();
+    start_counter(counter);
+
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    for (int i = 0; i < loops; i++)
+        for (int c = 0; c < columns; c++)
+            painter.drawRect(c * (w / columns), 0, columnWidth, h);
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    long long columns_ns = (end_time.tv_sec - start_time.tv_sec) * 1000000000LL + (end_time.tv_nsec - start_time.tv_nsec);
+
+    long long misses = finish_counter(counter);
+    painter.end();
+
+    long long rowBytes = (long long)w * h * format->bpp * loops;
+    long long columnBytes = (long long)columns * columnWidth * h * format->bpp * loops;
+
+    qDebug() << "strideTest:" << w << "x" << h << label << "stride" << buffer->stride << format->name << ": rows" << rowBytes * 1000 / rows_ns << "MB/s, columns" << columnBytes * 1000 / columns_ns << "MB/s," << misses << "L1D read misses";
+
+    destroy_buffer(buffer);
+}
+
+static void runStrideSweep(const PixelFormat *format)
+{
+    struct { int align; int pad; const char *label; } layouts[] =
+    {
+        {0, 0, "packed"},
+        {64, 0, "align 64"},
+        {256, 0, "align 256"},
+        {4096, 0, "align 4096"},
+        {0, 64, "packed + 64"},
+        {0, 256, "packed + 256"}
+    };
+
+    int alignSelected = options.shmStrideAlign;
+    int padSelected = options.shmStridePad;
+
+    // 1000 is the non power of two reference
+    for (int w : {1000, 1024, 2048})
+    {
+        for (const auto &layout : layouts)
+        {
+            options.shmStrideAlign = layout.align;
+            options.shmStridePad = layout.pad;
+            strideTest(w, height, format, layout.label);
+        }
+    }
+
+    options.shmStrideAlign = alignSelected;
+    options.shmStridePad = padSelected;
+}
+
+// Client + compositor tests
+
+static int next(int i, int max)
+{
+    if (i == max -1)
+        return 0;
+
+    return i+1;
+}
+
+static int prev(int i, int max)
+{
+    if (i == 0)
+        return max - 1;
+
+    return i-1;
+}
+
+static void renderTestDraw();
+
+static void wl_callback_handle_done(void *, struct wl_callback *callback, uint32_t);
+
+struct wl_callback_listener wl_callback_listener =
+{
+    .done = &wl_callback_handle_done
+};
+
+static unsigned long long nanos = 0;
+int writes = 0;
+static bool selfPaced = false;
+
+// Frames drawn into buffers never rendered before, kept out of the steady state average
+static unsigned long long firstTouchNanos = 0;
+
+// Split of the frame time with --display-list
+static unsigned long long recordNanos = 0;
+static unsigned long long replayNanos = 0;
+static DisplayList frameList;
+int firstTouchWrites = 0;
+static bool firstCommitted = false;
+struct timespec firstCommit;
+
+// Frame latency from each commit to its frame callback, mostly set by vblank and frame pacing
+struct timespec lastCommit;
+static unsigned long long commitToFrameNanos = 0;
+static long long damagedPixels = 0;
+static long long damageRects = 0;
+
+/* Bytes read plus written by render(), against a full redraw of every frame. A painted pixel is
+ * cleared (one write) then blended (one read, one write), a copied one is read and written once.
+ * Row padding is never counted */
+#define PAINT_ACCESSES 3
+#define COPY_ACCESSES 2
+static long long touchedBytes = 0;
+static long long bufferAges = 0;
+
+// Page faults and dTLB read misses of the rendering thread in render()
+static long long renderFaults = 0;
+static int renderTlbCounter = -1;
+
+static void commitBuffer(Buffer *buffer)
+{
+    if (!firstCommitted)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &firstCommit);
+        firstCommitted = true;
+    }
+
+    toplevel->pendingCallback = true;
+    wl_callback *callback = wl_surface_frame(toplevel->surface);
+    wl_callback_add_listener(callback, &wl_callback_listener, buffer);
+    wl_surface_attach(toplevel->surface, buffer->buffer, 0, 0);
+
+    if (buffer->damage.empty())
+    {
+        wl_surface_damage(toplevel->surface, 0, 0, buffer->width, buffer->height);
+        damagedPixels += (long long)buffer->width * buffer->height;
+        damageRects++;
+    }
+
+    for (const QRect &rect : buffer->damage)
+    {
+        // Surface coordinates before wl_surface version 4, rounded out
+        if (wl_surface_get_version(toplevel->surface) >= WL_SURFACE_DAMAGE_BUFFER_SINCE_VERSION)
+            wl_surface_damage_buffer(toplevel->surface, rect.x(), rect.y(), rect.width(), rect.height());
+        else
+            wl_surface_damage(toplevel->surface,
+                              rect.x() / bufferScale,
+                              rect.y() / bufferScale,
+                              rect.width() / bufferScale + 2,
+                              rect.height() / bufferScale + 2);
+
+        damagedPixels += (long long)rect.width() * rect.height();
+        damageRects++;
+    }
+
+    wl_surface_commit(toplevel->surface);
+    clock_gettime(CLOCK_MONOTONIC, &lastCommit);
+    buffer->realeased = false;
+    buffer->commited = true;
+    buffer->callbacked = false;
+}
+
+static void wl_callback_handle_done(void *, struct wl_callback *callback, uint32_t)
+{
+    Buffer *buffer = (Buffer*)wl_callback_get_user_data(callback);
+    wl_callback_destroy(callback);
+    buffer->callbacked = true;
+    toplevel->pendingCallback = false;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    commitToFrameNanos += (now.tv_sec - lastCommit.tv_sec) * 1000000000LL + (now.tv_nsec - lastCommit.tv_nsec);
+
+    // The startup and resize storm tests wait for their frames themselves
+    if (selfPaced)
+        return;
+
+    renderedFrames++;
+
+    clock_gettime(CLOCK_MONOTONIC, &renderEnd);
+    long long elapsed_ns = (renderEnd.tv_sec - renderStart.tv_sec) * 1000000000LL + (renderEnd.tv_nsec - renderEnd.tv_nsec);
+
+    if (renderedFrames == 1)
+    {
+        long long first_ns = (renderEnd.tv_sec - firstCommit.tv_sec) * 1000000000LL + (renderEnd.tv_nsec - firstCommit.tv_nsec);
+        qDebug() << "- FIRST COMMIT LATENCY:" << first_ns << "nanoseconds";
+    }
+
+    if (elapsed_ns >= 1000000000LL * 10LL)
+    {
+        float secs = elapsed_ns / 1000000000LL;
+
+        qDebug() << "- WRITES" << writes;
+        qDebug() << "- SECS:" << secs;
+        qDebug() << "- FRAMES:" << renderedFrames;
+        qDebug() << "- FPS:" << float(renderedFrames) / secs;
+        if (firstTouchWrites)
+            qDebug() << "- CLIENT RENDER FIRST TOUCH:" << firstTouchNanos / firstTouchWrites << "nanoseconds over" << firstTouchWrites << "buffers";
+
+        int steadyWrites = writes - firstTouchWrites;
+        qDebug() << "- CLIENT RENDER AVG:" << (steadyWrites ? (nanos - firstTouchNanos) / steadyWrites : 0) << "nanoseconds";
+
+        if (writes)
+        {
+            long long tlbMisses = -1;
+
+            if (renderTlbCounter >= 0 && read(renderTlbCounter, &tlbMisses, sizeof(tlbMisses)) != sizeof(tlbMisses))
+                tlbMisses = -1;
+
+            qDebug() << "- FAULTS PER FRAME:" << (double)renderFaults / writes;
+            qDebug() << "- DTLB READ MISSES PER FRAME:" << (tlbMisses < 0 ? -1 : tlbMisses / writes);
+        }
+
+        qDebug() << "- FRAME LATENCY AVG (commit to frame callback):" << commitToFrameNanos / renderedFrames << "nanoseconds";
+
+        if (options.damageFraction < 1.0)
+        {
+            qDebug() << "- DAMAGE AVG:" << 100.0 * damagedPixels / renderedFrames / (toplevel->buffers[0]->width * toplevel->buffers[0]->height) << "% in" << damageRects / renderedFrames << "rects";
+            qDebug() << "- BUFFER AGE AVG:" << (double)bufferAges / writes;
+        }
+
+        if (writes)
+        {
+            Buffer *first = toplevel->buffers[0];
+            long long fullBytes = PAINT_ACCESSES * (long long)first->width * first->format->bpp * first->height;
+            qDebug() << "- BYTES TOUCHED AVG:" << touchedBytes / writes << "bytes," << 100.0 * touchedBytes / writes / fullBytes << "% of a full redraw";
+        }
+
+        if (options.displayList && writes)
+        {
+            qDebug() << "- CLIENT RECORD AVG:" << recordNanos / writes << "nanoseconds for" << frameList.commands << "commands in" << display_list_size(&frameList) << "bytes";
+            qDebug() << "- CLIENT REPLAY AVG:" << replayNanos / writes << "nanoseconds";
+        }
+
+        long long footprint = 0;
+
+        for (int i = 0; i < toplevel->depth; i++)
+            footprint += toplevel->buffers[i]->mapSize;
+
+        qDebug() << "- MEMORY:" << footprint / 1024 << "KiB in" << toplevel->depth << "buffers";
+
+        if (testingDMA && surfaceFeedback && surfaceFeedback->done)
+        {
+            int scanout = 0;
+
+            for (int i = 0; i < toplevel->depth; i++)
+                scanout += dmabuf_tranche_is_scanout(surfaceFeedback, ((DMABuffer*)toplevel->buffers[i])->tranche);
+
+            qDebug() << "- SCANOUT TRANCHE BUFFERS:" << scanout << "of" << toplevel->depth;
+        }
+
+        benchFinished = true;
+        return;
+    }
+
+    if (!testingDMA)
+    {
+        for (int i = 0; i < toplevel->depth; i++)
+        {
+            if (!toplevel->buffers[i]->commited)
+            {
+                commitBuffer(toplevel->buffers[i]);
+                break;
+            }
+        }
+    }
+
+    renderTestDraw();
+}
+
+// render() content, limited to the cells that overlap rows top to bottom
+static const int renderSlices = 100;
+static std::vector<QColor> renderColors(renderSlices * renderSlices);
+
+static void paint_cells(QPainter &painter, int w, int h, int top, int bottom)
+{
+    QSize squareSize(w / renderSlices, h / renderSlices);
+
+    painter.setPen(Qt::NoPen);
+
+    painter.setCompositionMode(QPainter::CompositionMode_Source);
+    painter.setBrush(Qt::transparent);
+
+    painter.drawRect(0, top, w, bottom - top);
+    painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
+
+    int firstRow = squareSize.height() ? top / squareSize.height() : 0;
+    int lastRow = squareSize.height() ? std::min(renderSlices - 1, (bottom - 1) / squareSize.height()) : renderSlices - 1;
+
+    // One per band worker
+    thread_local RectBatch batch;
+
+    for (int x = 0; x < renderSlices; x++)
+    {
+        for (int y = firstRow; y <= lastRow; y++)
+        {
+            QRect rect(x * squareSize.width(),
+                       y * squareSize.height(),
+                       squareSize.width(),
+                       squareSize.height());
+
+            if (options.batchRects)
+                batch_add(&batch, renderColors[x * renderSlices + y], rect);
+            else
+            {
+                painter.setBrush(renderColors[x * renderSlices + y]);
+                painter.drawRect(rect);
+            }
+        }
+    }
+
+    if (options.batchRects)
+        batch_submit(&batch, painter);
+}
+
+/* Workers for --render-threads, each paints one horizontal band of the frame
+ * through its own QPainter clipped to the band, over the same memory */
+static struct RenderPool
+{
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable start;
+    std::condition_variable done;
+    int generation = 0;
+    int pending = 0;
+    int bands = 1;
+    bool quit = false;
+    Buffer *buffer = NULL;
+    uchar *target = NULL;
+} renderPool;
+
+static void paint_band(int band, int bands)
+{
+    Buffer *buffer = renderPool.buffer;
+    int top = buffer->height * band / bands;
+    int bottom = buffer->height * (band + 1) / bands;
+
+    QImage img = QImage(renderPool.target, buffer->width, buffer->height, buffer->stride, image_format(buffer->format));
+    QPainter painter(&img);
+    painter.setClipRect(0, top, buffer->width, bottom - top);
+    paint_cells(painter, buffer->width, buffer->height, top, bottom);
+    painter.end();
+}
+
+static void render_worker(int band)
+{
+    int generation = 0;
+
+    while (true)
+    {
+        std::unique_lock<std::mutex> lock(renderPool.mutex);
+        renderPool.start.wait(lock, [&]{ return renderPool.quit || renderPool.generation != generation; });
+
+        if (renderPool.quit)
+            return;
+
+        generation = renderPool.generation;
+        int bands = renderPool.bands;
+        lock.unlock();
+
+        paint_band(band, bands);
+
+        lock.lock();
+
+        if (--renderPool.pending == 0)
+            renderPool.done.notify_one();
+    }
+}
+
+// The calling thread paints the first band, so N threads means N - 1 workers
+static void set_render_threads(int count)
 {
-    (void)data;
-    xdg_surface_ack_configure(xdg_surface, serial);
-    toplevel->configured = true;
+    {
+        std::lock_guard<std::mutex> lock(renderPool.mutex);
+        renderPool.quit = true;
+    }
+
+    renderPool.start.notify_all();
+
+    for (std::thread &thread : renderPool.threads)
+        thread.join();
+
+    renderPool.threads.clear();
+    renderPool.quit = false;
+    renderPool.generation = 0;
+
+    for (int band = 1; band < count; band++)
+        renderPool.threads.emplace_back(render_worker, band);
 }
 
-static const struct xdg_surface_listener xdg_surface_listener =
+// Returns once every band is painted, before the DMA write ends or the buffer is committed
+static void render_bands(Buffer *buffer)
 {
-    .configure = xdg_surface_handle_configure,
-};
+    // Painters over the mapping or the shadow are per band, the buffer context is not used
+    release_render_context(buffer);
+    uchar *target = render_target(buffer);
+    int bands = renderPool.threads.size() + 1;
 
-static void xdg_toplevel_handle_configure(void *data, struct xdg_toplevel *xdg_toplevel, int32_t w, int32_t h, struct wl_array *states)
+    {
+        std::lock_guard<std::mutex> lock(renderPool.mutex);
+        renderPool.buffer = buffer;
+        renderPool.target = target;
+        renderPool.pending = bands - 1;
+        renderPool.bands = bands;
+        renderPool.generation++;
+    }
+
+    renderPool.start.notify_all();
+    paint_band(0, bands);
+
+    std::unique_lock<std::mutex> lock(renderPool.mutex);
+    renderPool.done.wait(lock, []{ return renderPool.pending == 0; });
+
+    if (buffer->shadow)
+        flush_shadow(buffer, 0, buffer->height);
+}
+
+static void render_kernels(Buffer *buffer)
 {
-    (void)data;
-    (void)xdg_toplevel;
-    (void)states;
+    uchar *target = render_target(buffer);
+    QSize squareSize(buffer->width / renderSlices, buffer->height / renderSlices);
+
+    blend_fill_rect(target, buffer->stride, 0, 0, buffer->width, buffer->height, 0);
+
+    for (int x = 0; x < renderSlices; x++)
+    {
+        for (int y = 0; y < renderSlices; y++)
+        {
+            blend_source_over_rect(target, buffer->stride,
+                                   x * squareSize.width(),
+                                   y * squareSize.height(),
+                                   squareSize.width(),
+                                   squareSize.height(),
+                                   blend_premultiply(renderColors[x * renderSlices + y].rgba()));
+        }
+    }
+
+    if (buffer->shadow)
+        flush_shadow(buffer, 0, buffer->height);
 }
 
-static void xdg_toplevel_handle_close(void *data, struct xdg_toplevel *xdg_toplevel)
+static long long renderFrame = 0;
+static std::vector<int> cellOrder;
+
+// Cells changed by each of the last frames, indexed by frame % DAMAGE_HISTORY
+#define DAMAGE_HISTORY 16
+static std::vector<int> damageHistory[DAMAGE_HISTORY];
+
+static QRect cell_rect(Buffer *buffer, int cell)
 {
-    (void)data;
-    (void)xdg_toplevel;
-    exit(1);
+    QSize squareSize(buffer->width / renderSlices, buffer->height / renderSlices);
+    return QRect(cell / renderSlices * squareSize.width(), cell % renderSlices * squareSize.height(), squareSize.width(), squareSize.height());
 }
 
-static const struct xdg_toplevel_listener xdg_toplevel_listener =
+// Rows of rect from the newest buffer, which holds the previous frame
+static void copy_rect(Buffer *buffer, uchar *target, const QRect &rect)
 {
-    .configure = &xdg_toplevel_handle_configure,
-    .close = &xdg_toplevel_handle_close
-};
+    const uchar *source = newestBuffer->shadow ? newestBuffer->shadow : newestBuffer->pixels;
+    size_t offset = rect.x() * buffer->format->bpp;
+    size_t size = rect.width() * buffer->format->bpp;
 
-static void createToplevel()
+    for (int row = rect.y(); row < rect.y() + rect.height(); row++)
+        memcpy(&target[row * buffer->stride + offset], &source[row * buffer->stride + offset], size);
+}
+
+static bool can_copy_from_newest(Buffer *buffer)
 {
-    toplevel = new Toplevel();
-    toplevel->surface = wl_compositor_create_surface(compositor);
+    return options.repairCopy && newestBuffer && newestBuffer != buffer &&
+           newestBuffer->paintedFrame == renderFrame - 1 &&
+           newestBuffer->width == buffer->width && newestBuffer->height == buffer->height &&
+           newestBuffer->stride == buffer->stride && newestBuffer->format == buffer->format;
+}
 
-    toplevel->xdgSurface = xdg_wm_base_get_xdg_surface(wm_base, toplevel->surface);
-    xdg_surface_add_listener(toplevel->xdgSurface, &xdg_surface_listener, toplevel);
+/* Changes a random share of the cells and damages only those. A reused buffer still holds the frame
+ * it was last painted with, so the cells changed by the frames it missed are repaired as well,
+ * either by painting them again or by copying them from the newest buffer */
+static void render_partial(Buffer *buffer)
+{
+    int cells = renderSlices * renderSlices;
+    int changed = std::max(1L, lround(options.damageFraction * cells));
+    std::vector<int> &current = damageHistory[renderFrame % DAMAGE_HISTORY];
 
-    toplevel->xdgToplevel = xdg_surface_get_toplevel(toplevel->xdgSurface);
-    xdg_toplevel_add_listener(toplevel->xdgToplevel, &xdg_toplevel_listener, toplevel);
+    if (cellOrder.empty())
+        for (int cell = 0; cell < cells; cell++)
+            cellOrder.push_back(cell);
 
-    wl_surface_set_buffer_scale(toplevel->surface, bufferScale);
-    wl_surface_attach(toplevel->surface, NULL, 0, 0);
+    current.clear();
+
+    // Partial Fisher-Yates, the first changed entries are distinct random cells
+    for (int i = 0; i < changed; i++)
+    {
+        std::swap(cellOrder[i], cellOrder[i + rand() % (cells - i)]);
+        int cell = cellOrder[i];
+        renderColors[cell] = QColor(rand() % 255, rand() % 255, rand() % 255, 200);
+        current.push_back(cell);
+        buffer->damage.push_back(cell_rect(buffer, cell));
+    }
+
+    long long age = buffer->paintedFrame < 0 ? 0 : renderFrame - buffer->paintedFrame;
+    bufferAges += age;
+
+    QPainter &painter = *begin_frame(buffer);
+
+    // Unknown content or older than the history, same as a buffer age of 0
+    if (age == 0 || age > DAMAGE_HISTORY)
+    {
+        // Anything outside this frame's cells may be stale on the compositor side too
+        buffer->damage.clear();
+        paint_cells(painter, buffer->width, buffer->height, 0, buffer->height);
+        end_frame(buffer);
+        buffer->paintedFrame = renderFrame;
+        newestBuffer = buffer;
+        touchedBytes += PAINT_ACCESSES * (long long)buffer->width * buffer->format->bpp * buffer->height;
+        return;
+    }
+
+    // 1 for cells to paint, 2 for cells to copy, this frame's cells are always painted
+    static std::vector<uchar> repair;
+    repair.assign(cells, 0);
+    bool copy = can_copy_from_newest(buffer);
+
+    for (long long frame = buffer->paintedFrame + 1; frame < renderFrame; frame++)
+        for (int cell : damageHistory[frame % DAMAGE_HISTORY])
+            repair[cell] = copy ? 2 : 1;
+
+    for (int cell : current)
+        repair[cell] = 1;
+
+    if (copy && newestBuffer->dma && !newestBuffer->shadow)
+        dmaReadBegin((DMABuffer*)newestBuffer);
+
+    int top = buffer->height, bottom = 0;
+    painter.setPen(Qt::NoPen);
+
+    for (int cell = 0; cell < cells; cell++)
+    {
+        if (!repair[cell])
+            continue;
+
+        QRect rect = cell_rect(buffer, cell);
+        long long bytes = (long long)rect.width() * rect.height() * buffer->format->bpp;
+
+        if (repair[cell] == 2)
+        {
+            copy_rect(buffer, buffer->image->bits(), rect);
+            touchedBytes += COPY_ACCESSES * bytes;
+        }
+        else
+        {
+            painter.setCompositionMode(QPainter::CompositionMode_Source);
+            painter.setBrush(Qt::transparent);
+            painter.drawRect(rect);
+            painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
+            painter.setBrush(renderColors[cell]);
+            painter.drawRect(rect);
+            touchedBytes += PAINT_ACCESSES * bytes;
+        }
+
+        top = std::min(top, rect.y());
+        bottom = std::max(bottom, rect.y() + rect.height());
+    }
+
+    if (copy && newestBuffer->dma && !newestBuffer->shadow)
+        dmaReadEnd((DMABuffer*)newestBuffer);
+
+    end_frame(buffer, std::min(top, bottom), bottom);
+    buffer->paintedFrame = renderFrame;
+    newestBuffer = buffer;
+}
+
+// Buffers hold no frame of the next test
+static void set_damage_fraction(double fraction)
+{
+    options.damageFraction = fraction;
+
+    for (int i = 0; i < buffCount; i++)
+    {
+        shmBuffers[i]->paintedFrame = -1;
+        dmaBuffers[i]->paintedFrame = -1;
+    }
+
+    qDebug() << "Damage fraction:" << fraction;
+}
+
+// Same commands as paint_cells() over the whole frame
+static void record_cells(DisplayList *list, int w, int h)
+{
+    QSize squareSize(w / renderSlices, h / renderSlices);
+
+    display_list_reset(list);
+    display_list_no_pen(list);
+    display_list_composition(list, QPainter::CompositionMode_Source);
+    display_list_brush(list, Qt::transparent);
+    display_list_rect(list, 0, 0, w, h);
+    display_list_composition(list, QPainter::CompositionMode_SourceOver);
+
+    for (int x = 0; x < renderSlices; x++)
+    {
+        for (int y = 0; y < renderSlices; y++)
+        {
+            display_list_brush(list, renderColors[x * renderSlices + y]);
+            display_list_rect(list,
+                              x * squareSize.width(),
+                              y * squareSize.height(),
+                              squareSize.width(),
+                              squareSize.height());
+        }
+    }
+}
+
+static void render_display_list(Buffer *buffer)
+{
+    struct timespec start, recorded, replayed;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    record_cells(&frameList, buffer->width, buffer->height);
+
+    clock_gettime(CLOCK_MONOTONIC, &recorded);
+
+    if (options.kernelRenderer && kernel_supported(buffer))
+    {
+        display_list_replay_kernels(&frameList, render_target(buffer), buffer->stride);
+
+        if (buffer->shadow)
+            flush_shadow(buffer, 0, buffer->height);
+    }
+    else
+    {
+        QPainter &painter = *begin_frame(buffer);
+        display_list_replay(&frameList, painter);
+        end_frame(buffer);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &replayed);
+    recordNanos += (recorded.tv_sec - start.tv_sec) * 1000000000LL + (recorded.tv_nsec - start.tv_nsec);
+    replayNanos += (replayed.tv_sec - recorded.tv_sec) * 1000000000LL + (replayed.tv_nsec - recorded.tv_nsec);
+}
+
+static void render(Buffer *buffer)
+{
+    struct timespec start_time, end_time;
+    long long elapsed_ns;
+    long start_faults = minor_faults();
+
+    if (renderTlbCounter >= 0)
+        ioctl(renderTlbCounter, PERF_EVENT_IOC_ENABLE, 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    if (testingDMA)
+        dmaWriteBegin((DMABuffer*)buffer);
+
+    renderFrame++;
+    buffer->damage.clear();
+
+    // Picked up front so the single and multithreaded paths draw the same frame
+    if (options.damageFraction >= 1.0)
+    {
+        for (QColor &color : renderColors)
+            color = QColor(rand() % 255, rand() % 255, rand() % 255, 200);
+
+        touchedBytes += PAINT_ACCESSES * (long long)buffer->width * buffer->format->bpp * buffer->height;
+    }
+
+    if (options.damageFraction < 1.0)
+        render_partial(buffer);
+    else if (options.displayList)
+        render_display_list(buffer);
+    else if (options.kernelRenderer && kernel_supported(buffer))
+        render_kernels(buffer);
+    else if (renderPool.threads.empty())
+    {
+        QPainter &painter = *begin_frame(buffer);
+        paint_cells(painter, buffer->width, buffer->height, 0, buffer->height);
+        end_frame(buffer);
+    }
+    else
+        render_bands(buffer);
+
+    if (testingDMA)
+        dmaWriteEnd((DMABuffer*)buffer);
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+
+    if (renderTlbCounter >= 0)
+        ioctl(renderTlbCounter, PERF_EVENT_IOC_DISABLE, 0);
+
+    renderFaults += minor_faults() - start_faults;
+    elapsed_ns = (end_time.tv_sec - start_time.tv_sec) * 1000000000LL + (end_time.tv_nsec - start_time.tv_nsec);
+
+    nanos += elapsed_ns;
+    writes++;
+
+    if (!buffer->rendered)
+    {
+        firstTouchNanos += elapsed_ns;
+        firstTouchWrites++;
+        buffer->rendered = true;
+    }
+}
+
+static void renderTestDraw()
+{
+    if (options.followConfigure && (toplevel->buffers[0]->width != toplevel->width || toplevel->buffers[0]->height != toplevel->height))
+    {
+        resize_swapchain(testingDMA, toplevel->width, toplevel->height);
+
+        // Restart the DMA ring, the buffer behind the current one is committed next
+        if (testingDMA)
+        {
+            render(toplevel->buffers[0]);
+            toplevel->i = next(0, toplevel->depth);
+        }
+    }
+
+    if (testingDMA)
+    {
+        render(toplevel->buffers[toplevel->i]);
+        Buffer *buffer = toplevel->buffers[prev(toplevel->i, toplevel->depth)];
+        commitBuffer(buffer);
+        toplevel->i = next(toplevel->i, toplevel->depth);
+        return;
+    }
+
+    // A rendered frame is already waiting for the frame callback
+    for (int i = 0; i < toplevel->depth; i++)
+        if (!toplevel->buffers[i]->commited)
+            return;
+
+    Buffer *buffer = NULL;
+
+    for (int i = 0; i < toplevel->depth; i++)
+    {
+        if (toplevel->buffers[i]->realeased)
+        {
+            buffer = toplevel->buffers[i];
+            break;
+        }
+    }
+
+    if (!buffer)
+        return;
+
+    render(buffer);
+    buffer->commited = false;
+
+    if (toplevel->pendingCallback)
+        return;
+
+    commitBuffer(buffer);
+
+    // Render ahead into another free buffer while this one is on screen
+    renderTestDraw();
+
+/*
+    // Check if there is a non commited buffer
+    for (int i = 0; i < 1; i++)
+    {
+        if (!toplevel->pendingCallback && !toplevel->buffers[i]->commited)
+        {
+            qDebug() << "SEND ALREADY RENDERED BUFF" << i;
+
+            toplevel->pendingCallback = true;
+            wl_callback *callback = wl_surface_frame(toplevel->surface);
+            wl_callback_add_listener(callback, &wl_callback_listener,  toplevel->buffers[i]);
+            wl_surface_attach(toplevel->surface, toplevel->buffers[i]->buffer, 0, 0);
+            wl_surface_damage(toplevel->surface, 0, 0, toplevel->buffers[i]->width, toplevel->buffers[i]->height);
+            wl_surface_commit(toplevel->surface);
+            toplevel->buffers[i]->realeased = false;
+            toplevel->buffers[i]->commited = true;
+            toplevel->buffers[i]->callbacked = false;
+            break;
+        }
+    }
+
+    Buffer *buffer = nullptr;
+    int index = -1;
+
+    // Find a free buffer
+    for (int i = 0; i < 1; i++)
+    {
+        if (toplevel->buffers[i]->commited && toplevel->buffers[i]->callbacked && toplevel->buffers[i]->realeased)
+        {
+            index = i;
+            buffer = toplevel->buffers[i];
+            break;
+        }
+    }
+
+    // If no buffer free buffer, wait for frame callback or buffer release
+    if (!buffer)
+        return;
+
+    qDebug() << "RENDER" << index;
+
+
+
+    buffer->commited = false;
+
+    if (toplevel->pendingCallback)
+    {
+        renderTestDraw();
+        return;
+    }
+
+    qDebug() << "SEND BUFF" << index;
+
+    toplevel->pendingCallback = true;
+    wl_callback *callback = wl_surface_frame(toplevel->surface);
+    wl_callback_add_listener(callback, &wl_callback_listener, buffer);
+    wl_surface_attach(toplevel->surface, buffer->buffer, 0, 0);
+    wl_surface_damage(toplevel->surface, 0, 0, buffer->width, buffer->height);
     wl_surface_commit(toplevel->surface);
+    buffer->realeased = false;
+    buffer->commited = true;
+    buffer->callbacked = false;
+
+    // If DMA, try to render next frame immediatly
+    if (testingDMA)
+        renderTestDraw();
+*/
+}
 
-    wl_display_roundtrip(display);
+static void wl_buffer_handle_release(void *, wl_buffer *buff)
+{
+    Buffer *buffer = (Buffer*)wl_buffer_get_user_data(buff);
+    buffer->realeased = true;
 
-    while (!toplevel->configured)
-        wl_display_roundtrip(display);
+    if (!testingDMA && !selfPaced)
+        renderTestDraw();
+}
 
+static void renderTestSHMBegin()
+{
+    qDebug() << "SHM Rendering Test:";
+    writes = 0;
+    testingDMA = false;
+    renderedFrames = 0;
+    nanos = 0;
+    firstTouchNanos = 0;
+    firstTouchWrites = 0;
+    firstCommitted = false;
+    recordNanos = 0;
+    replayNanos = 0;
+    commitToFrameNanos = 0;
+    damagedPixels = 0;
+    damageRects = 0;
+    touchedBytes = 0;
+    bufferAges = 0;
+    renderFaults = 0;
+
+    // Kept open across tests, only enabled inside render()
+    if (renderTlbCounter < 0)
+        renderTlbCounter = open_dtlb_miss_counter();
+
+    if (renderTlbCounter >= 0)
+        ioctl(renderTlbCounter, PERF_EVENT_IOC_RESET, 0);
     toplevel->buffers = shmBuffers;
 
-}
+    // Drop frames left rendered but never committed by a previous run
+    for (int i = 0; i < toplevel->depth; i++)
+        toplevel->buffers[i]->commited = true;
 
-static void dmaWriteBegin(DMABuffer *buffer)
-{
-    buffer->sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE;
-    ioctl(buffer->buffer.fd, DMA_BUF_IOCTL_SYNC, &buffer->sync);
+    clock_gettime(CLOCK_MONOTONIC, &renderStart);
+    renderTestDraw();
 }
 
-static void dmaWriteEnd(DMABuffer *buffer)
+static void renderTestDMABegin()
 {
-    buffer->sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE;
-    ioctl(buffer->buffer.fd, DMA_BUF_IOCTL_SYNC, &buffer->sync);
+    qDebug() << "DMA Rendering Test:";
+    writes = 0;
+    testingDMA = true;
+    renderedFrames = 0;
+    nanos = 0;
+    firstTouchNanos = 0;
+    firstTouchWrites = 0;
+    firstCommitted = false;
+    recordNanos = 0;
+    replayNanos = 0;
+    commitToFrameNanos = 0;
+    damagedPixels = 0;
+    damageRects = 0;
+    touchedBytes = 0;
+    bufferAges = 0;
+    renderFaults = 0;
+
+    // Kept open across tests, only enabled inside render()
+    if (renderTlbCounter < 0)
+        renderTlbCounter = open_dtlb_miss_counter();
+
+    if (renderTlbCounter >= 0)
+        ioctl(renderTlbCounter, PERF_EVENT_IOC_RESET, 0);
+    toplevel->buffers = dmaBuffers;
+    clock_gettime(CLOCK_MONOTONIC, &renderStart);
+    Buffer *buffer = toplevel->buffers[0];
+    render(buffer);
+    toplevel->i = next(0, toplevel->depth);
+    renderTestDraw();
 }
 
-// Client only tests
-
-static void drawTest1(bool isDMA, Buffer *buffer, int slices)
+static void runRenderTest(bool dma)
 {
-    struct timespec start_time, end_time;
-    long long elapsed_ns;
-    clock_gettime(CLOCK_MONOTONIC, &start_time);
-
-    // BEGIN
-
-    QImage img = QImage(buffer->pixels, buffer->width, buffer->height, QImage::Format_ARGB32);
-    QPainter painter(&img);
+    usleep(1000000);
 
-    int loops = 10;
+    if (dma)
+        renderTestDMABegin();
+    else
+        renderTestSHMBegin();
 
-    QSize squareSize(img.width() / slices, img.height() / slices);
+    while (wl_display_dispatch(display) != -1)
+    {
+        if (benchFinished)
+        {
+            benchFinished = false;
+            break;
+        }
+    }
+}
 
-    painter.setPen(Qt::NoPen);
+// Time from the first DMA allocation to the first presented frame for each creation path
+static void runStartupTest()
+{
+    qDebug() << "DMA Startup Test:";
 
-    if (isDMA)
-        dmaWriteBegin((DMABuffer*)buffer);
+    DMACreate selected = options.dmaCreate;
+    testingDMA = true;
+    selfPaced = true;
 
-    for (int i = 0; i < loops; i++)
+    for (DMACreate mode : {DMA_CREATE_ROUNDTRIP, DMA_CREATE_BATCH, DMA_CREATE_ASYNC})
     {
-        for (int x = 0; x < slices; x++)
+        options.dmaCreate = mode;
+        std::vector<Buffer*> buffers;
+        struct timespec start, created, presented;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (int i = 0; i < options.depth; i++)
         {
-            for (int y = 0; y < slices; y++)
-            {
-                painter.setBrush(QColor(x, y, x + y));
-                painter.drawRect(x * squareSize.width(),
-                                 y * squareSize.height(),
-                                 squareSize.width(),
-                                 squareSize.height());
-            }
+            Buffer *shmView = NULL;
+            buffers.push_back(create_selected_dma_buffer(width, height, options.formats[0], &shmView));
         }
-    }
-    painter.end();
 
-    if (isDMA)
-        dmaWriteEnd((DMABuffer*)buffer);
-
-    // END
+        wait_dma_buffers();
+        clock_gettime(CLOCK_MONOTONIC, &created);
 
-    clock_gettime(CLOCK_MONOTONIC, &end_time);
-    elapsed_ns = (end_time.tv_sec - start_time.tv_sec) * 1000000000LL + (end_time.tv_nsec - start_time.tv_nsec);
+        render(buffers[0]);
+        commitBuffer(buffers[0]);
 
-    qDebug() << "drawTest1:" << slices * slices << "drawRect() opaque calls of " << squareSize << (isDMA ? "DMA" : "SHM") << ":" << elapsed_ns / loops << "nanoseconds";
-}
+        while (toplevel->pendingCallback && wl_display_dispatch(display) != -1) {}
 
-static void drawTest2(bool isDMA, Buffer *buffer, int slices)
-{
-    struct timespec start_time, end_time;
-    long long elapsed_ns;
-    clock_gettime(CLOCK_MONOTONIC, &start_time);
+        clock_gettime(CLOCK_MONOTONIC, &presented);
+        long long created_ns = (created.tv_sec - start.tv_sec) * 1000000000LL + (created.tv_nsec - start.tv_nsec);
+        long long presented_ns = (presented.tv_sec - start.tv_sec) * 1000000000LL + (presented.tv_nsec - start.tv_nsec);
+        qDebug() << "-" << dma_create_name(mode) << "CREATED:" << created_ns << "nanoseconds FIRST FRAME:" << presented_ns << "nanoseconds";
 
-    // BEGIN
+        // The compositor keeps its own import of the buffer still on screen
+        for (Buffer *buffer : buffers)
+            destroy_buffer(buffer);
+    }
 
-    QImage img = QImage(buffer->pixels, buffer->width, buffer->height, QImage::Format_ARGB32);
-    QPainter painter(&img);
+    options.dmaCreate = selected;
+    selfPaced = false;
+}
 
-    int loops = 10;
+// Resizes the swapchain every frame following a triangle wave of sizes
+static void runResizeStorm(bool dma)
+{
+    qDebug() << (dma ? "DMA" : "SHM") << "Resize Storm Test:";
 
-    QSize squareSize(img.width() / slices, img.height() / slices);
+    testingDMA = dma;
+    selfPaced = true;
+    toplevel->buffers = dma ? dmaBuffers : shmBuffers;
 
-    painter.setPen(Qt::NoPen);
+    int baseWidth = toplevel->buffers[0]->width;
+    int baseHeight = toplevel->buffers[0]->height;
+    long long peak = swapchain_bytes(toplevel->buffers);
+    long long total_ns = 0, max_ns = 0;
+    BufferCache *cache = NULL;
 
-    if (isDMA)
-        dmaWriteBegin((DMABuffer*)buffer);
+    shmCache.hits = shmCache.recycles = shmCache.misses = 0;
+    dmaCache.hits = dmaCache.recycles = dmaCache.misses = 0;
 
-    for (int i = 0; i < loops; i++)
+    for (int step = 1; step <= options.resizeStormSteps; step++)
     {
-        for (int x = 0; x < slices; x++)
-        {
-            for (int y = 0; y < slices; y++)
-            {
-                painter.setBrush(QColor(x, y, x + y, 50));
-                painter.drawRect(x * squareSize.width(),
-                                 y * squareSize.height(),
-                                 squareSize.width(),
-                                 squareSize.height());
-            }
-        }
+        int phase = step % 16;
+        int shrink = (phase < 8 ? phase : 16 - phase) * 16;
+        int w = std::max(64, baseWidth - shrink);
+        int h = std::max(64, baseHeight - shrink);
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        cache = resize_swapchain(dma, w, h);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        long long elapsed_ns = (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+        total_ns += elapsed_ns;
+        max_ns = std::max(max_ns, elapsed_ns);
+        peak = std::max(peak, swapchain_bytes(toplevel->buffers) + cache->bytes);
+
+        // Fresh and recycled buffers are always released
+        Buffer *buffer = toplevel->buffers[0];
+        render(buffer);
+        commitBuffer(buffer);
+
+        while (toplevel->pendingCallback && wl_display_dispatch(display) != -1) {}
     }
-    painter.end();
 
-    if (isDMA)
-        dmaWriteEnd((DMABuffer*)buffer);
+    qDebug() << "- RESIZES:" << options.resizeStormSteps;
+    qDebug() << "- ALLOC TOTAL:" << total_ns << "nanoseconds";
+    qDebug() << "- ALLOC AVG:" << (options.resizeStormSteps ? total_ns / options.resizeStormSteps : 0) << "nanoseconds";
+    qDebug() << "- ALLOC MAX:" << max_ns << "nanoseconds";
+    qDebug() << "- CACHE HITS:" << cache->hits << "RECYCLES:" << cache->recycles << "MISSES:" << cache->misses;
+    qDebug() << "- PEAK MEMORY:" << peak / 1024 << "KiB";
 
-    // END
+    resize_swapchain(dma, baseWidth, baseHeight);
+    selfPaced = false;
+}
 
-    clock_gettime(CLOCK_MONOTONIC, &end_time);
-    elapsed_ns = (end_time.tv_sec - start_time.tv_sec) * 1000000000LL + (end_time.tv_nsec - start_time.tv_nsec);
+static std::vector<bool> alpha_modes()
+{
+    if (options.alphaCompare)
+        return {false, true};
 
-    qDebug() << "drawTest2:" << slices * slices << "drawRect() translucent calls of " << squareSize << (isDMA ? "DMA" : "SHM") << ":" << elapsed_ns / loops << "nanoseconds";
+    return {options.premultiplied};
 }
 
-static void drawTest3(bool isDMA, Buffer *buffer)
+// Painters kept by --render-context=persistent are bound to the previous QImage format
+static void set_premultiplied(bool premultiplied, const std::vector<Buffer*> &buffers)
 {
-    struct timespec start_time, end_time;
-    long long elapsed_ns;
-    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    options.premultiplied = premultiplied;
 
-    // BEGIN
+    for (Buffer *buffer : buffers)
+        release_render_context(buffer);
 
-    QImage img = QImage(buffer->pixels, buffer->width, buffer->height, QImage::Format_ARGB32);
-    QPainter painter(&img);
+    // Pixels of the other mode are not reused
+    for (int i = 0; i < buffCount; i++)
+    {
+        release_render_context(shmBuffers[i]);
+        release_render_context(dmaBuffers[i]);
+        shmBuffers[i]->paintedFrame = -1;
+        dmaBuffers[i]->paintedFrame = -1;
+    }
 
-    int loops = 10;
+    if (options.alphaCompare)
+        qDebug() << "Alpha:" << (premultiplied ? "premultiplied" : "straight");
+}
 
-    painter.setBrush(Qt::black);
+static void runRenderTests()
+{
+    // Shadows are created up front rather than by the first timed render()
+    for (int i = 0; i < buffCount; i++)
+    {
+        render_target(shmBuffers[i]);
+        render_target(dmaBuffers[i]);
+    }
 
-    int col;
+    std::vector<double> fractions = {options.damageFraction};
 
-    if (isDMA)
-        dmaWriteBegin((DMABuffer*)buffer);
+    if (options.damageSweep)
+        fractions = {1.0, 0.5, 0.25, 0.1, 0.05, 0.01};
 
-    for (int i = 0; i < loops; i++)
+    for (double fraction : fractions)
     {
-        for (int x = 0; x < img.width(); x++)
+        if (options.damageSweep || fraction < 1.0)
+            set_damage_fraction(fraction);
+
+        for (bool premultiplied : alpha_modes())
         {
-            col = x % 255;
-            painter.setPen(QColor(col, col, col));
-            painter.drawLine(x, 0, 0, x);
+            set_premultiplied(premultiplied, {});
+            runRenderTest(false);
+            runRenderTest(true);
         }
     }
-    painter.end();
-
-    if (isDMA)
-        dmaWriteEnd((DMABuffer*)buffer);
-
-    // END
-
-    clock_gettime(CLOCK_MONOTONIC, &end_time);
-    elapsed_ns = (end_time.tv_sec - start_time.tv_sec) * 1000000000LL + (end_time.tv_nsec - start_time.tv_nsec);
+}
 
-    qDebug() << "drawTest3:" << img.width() << "diagonal drawLine() opaque calls"  << (isDMA ? "DMA" : "SHM") << ":" << elapsed_ns / loops << "nanoseconds";
+static bool shm_format_supported(const PixelFormat *format)
+{
+    return std::find(shmFormats.begin(), shmFormats.end(), format->shm) != shmFormats.end();
 }
 
-static void drawTest4(bool isDMA, Buffer *buffer)
+static bool dma_format_supported(const PixelFormat *format)
 {
-    struct timespec start_time, end_time;
-    long long elapsed_ns;
-    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    // Without feedback only the formats every linux-dmabuf compositor takes are tried
+    if (!defaultFeedback)
+        return format->drm == DRM_FORMAT_ARGB8888 || format->drm == DRM_FORMAT_XRGB8888;
 
-    // BEGIN
+    // Mapped buffers are only sent as linear
+    return dmabuf_feedback_find_tranche(defaultFeedback, format->drm, DRM_FORMAT_MOD_LINEAR) >= 0;
+}
 
-    QImage img = QImage(buffer->pixels, buffer->width, buffer->height, QImage::Format_ARGB32);
-    QPainter painter(&img);
+// Client only tests, one output line per column for each test
+static void runDrawTests(const std::vector<Buffer*> &columns)
+{
+    // Probes of new buffer types and shadow creation must not land inside a timed test
+    for (Buffer *buffer : columns)
+    {
+        if (options.renderTarget == RENDER_AUTO)
+            probe_mapping(buffer);
 
-    int loops = 10;
+        render_target(buffer);
+    }
 
-    painter.setBrush(QColor(50, 50, 50, 50));
+    for (int slices : {100, 10, 1})
+    {
+        for (Buffer *buffer : columns)
+            drawTest1(buffer, slices);
 
-    int col;
+        for (Buffer *buffer : columns)
+            if (kernel_supported(buffer))
+                kernelTest(buffer, slices, false);
 
-    if (isDMA)
-        dmaWriteBegin((DMABuffer*)buffer);
+        for (Buffer *buffer : columns)
+            drawTest2(buffer, slices);
 
-    for (int i = 0; i < loops; i++)
-    {
-        for (int x = 0; x < img.width(); x++)
-        {
-            col = x % 255;
-            painter.setPen(QColor(col, col, col, 50));
-            painter.drawLine(x, 0, 0, x);
-        }
+        for (Buffer *buffer : columns)
+            if (kernel_supported(buffer))
+                kernelTest(buffer, slices, true);
     }
-    painter.end();
 
-    if (isDMA)
-        dmaWriteEnd((DMABuffer*)buffer);
+    for (Buffer *buffer : columns)
+        drawTest3(buffer);
 
-    // END
+    for (Buffer *buffer : columns)
+    {
+        drawTest4(buffer);
 
-    clock_gettime(CLOCK_MONOTONIC, &end_time);
-    elapsed_ns = (end_time.tv_sec - start_time.tv_sec) * 1000000000LL + (end_time.tv_nsec - start_time.tv_nsec);
+        // Already faulted in, render() must not count it as a first touch
+        buffer->rendered = true;
+    }
 
-    qDebug() << "drawTest4:" << img.width() << "diagonal drawLine() translucent calls"  << (isDMA ? "DMA" : "SHM") << ":" << elapsed_ns / loops << "nanoseconds";
-}
+    for (Buffer *buffer : columns)
+        drawTest5(buffer);
 
-// Client + compositor tests
+    for (int paletteSize : {0, 16})
+        for (Buffer *buffer : columns)
+            drawTest6(buffer, paletteSize);
 
-static int next(int i, int max)
-{
-    if (i == max -1)
-        return 0;
+    for (TextMethod method : {TEXT_DRAW_TEXT, TEXT_LAYOUT, TEXT_GLYPH_RUN})
+        for (int pointSize : {8, 12, 24})
+            for (bool translucent : {false, true})
+                for (Buffer *buffer : columns)
+                    drawTest7(buffer, method, pointSize, translucent);
 
-    return i+1;
+    for (BlitMode mode : {BLIT_COPY, BLIT_SCALE_2X, BLIT_SCALE_FAST, BLIT_SCALE_SMOOTH, BLIT_ROTATE})
+        for (bool alpha : {false, true})
+            for (Buffer *buffer : columns)
+                drawTest8(buffer, mode, alpha);
 }
 
-static int prev(int i, int max)
+// Every drawTest on SHM buffers placed on the rendering thread's node and on another one
+static void runNumaCompare(const PixelFormat *format)
 {
-    if (i == 0)
-        return max - 1;
-
-    return i-1;
-}
+    std::vector<int> nodes = numa_nodes();
 
-static void renderTestDraw();
+    if (nodes.size() < 2)
+    {
+        qDebug() << "NUMA comparison skipped, only" << nodes.size() << "node";
+        return;
+    }
 
-static void wl_callback_handle_done(void *, struct wl_callback *callback, uint32_t);
+    int local = options.numaCpu >= 0 ? options.numaCpu : current_numa_node();
+    int remote = nodes[0] == local ? nodes[1] : nodes[0];
 
-struct wl_callback_listener wl_callback_listener =
-{
-    .done = &wl_callback_handle_done
-};
+    // Keep the scheduler from moving the thread next to the remote buffer, until the comparison ends
+    cpu_set_t affinity;
+    sched_getaffinity(0, sizeof(affinity), &affinity);
 
-static unsigned long long nanos = 0;
-int writes = 0;
+    if (options.numaCpu < 0)
+        bind_thread_to_node(local);
 
-static void wl_callback_handle_done(void *, struct wl_callback *callback, uint32_t)
-{
-    Buffer *buffer = (Buffer*)wl_callback_get_user_data(callback);
-    wl_callback_destroy(callback);
-    renderedFrames++;
-    buffer->callbacked = true;
-    toplevel->pendingCallback = false;
+    qDebug() << "NUMA comparison: rendering thread on node" << local << "remote node" << remote;
 
-    clock_gettime(CLOCK_MONOTONIC, &renderEnd);
-    long long elapsed_ns = (renderEnd.tv_sec - renderStart.tv_sec) * 1000000000LL + (renderEnd.tv_nsec - renderEnd.tv_nsec);
+    Buffer *localBuffer = create_shm_buffer(width, height, format);
+    Buffer *remoteBuffer = create_shm_buffer(width, height, format);
+    localBuffer->type = "SHM-LOCAL";
+    remoteBuffer->type = "SHM-REMOTE";
 
-    if (elapsed_ns >= 1000000000LL * 10LL)
-    {
-        float secs = elapsed_ns / 1000000000LL;
+    if (!bind_memory_to_node(localBuffer->pixels, localBuffer->mapSize, local) ||
+        !bind_memory_to_node(remoteBuffer->pixels, remoteBuffer->mapSize, remote))
+        qWarning() << "mbind failed, NUMA comparison buffers use the default policy";
 
-        qDebug() << "- WRITES" << writes;
-        qDebug() << "- SECS:" << secs;
-        qDebug() << "- FRAMES:" << renderedFrames;
-        qDebug() << "- FPS:" << float(renderedFrames) / secs;
+    touch_pages(localBuffer->pixels, localBuffer->mapSize);
+    touch_pages(remoteBuffer->pixels, remoteBuffer->mapSize);
 
-        benchFinished = true;
-        return;
-    }
+    runDrawTests({localBuffer, remoteBuffer});
 
-    if (!testingDMA && !toplevel->buffers[0]->commited)
-    {
-        Buffer *buffer = toplevel->buffers[0];
-        toplevel->pendingCallback = true;
-        wl_callback *callback = wl_surface_frame(toplevel->surface);
-        wl_callback_add_listener(callback, &wl_callback_listener, buffer);
-        wl_surface_attach(toplevel->surface, buffer->buffer, 0, 0);
-        wl_surface_damage(toplevel->surface, 0, 0, buffer->width, buffer->height);
-        wl_surface_commit(toplevel->surface);
-        buffer->realeased = false;
-        buffer->commited = true;
-        buffer->callbacked = false;
-        return;
-    }
+    destroy_buffer(localBuffer);
+    destroy_buffer(remoteBuffer);
 
-    renderTestDraw();
+    if (options.numaCpu < 0)
+        sched_setaffinity(0, sizeof(affinity), &affinity);
 }
 
-static void render(Buffer *buffer)
+static bool parseOption(const char *arg)
 {
-    struct timespec start_time, end_time;
-    long long elapsed_ns;
-    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    const char *value = strchr(arg, '=');
 
-    if (testingDMA)
-        dmaWriteBegin((DMABuffer*)buffer);
+    if (strncmp(arg, "--", 2) != 0 || !value)
+        return false;
 
-    QImage img = QImage(buffer->pixels, buffer->width, buffer->height, QImage::Format_ARGB32);
-    QPainter painter(&img);
+    std::string name(arg + 2, value - arg - 2);
+    value++;
 
-    int slices = 100;
+    if (name == "shm-alloc")
+    {
+        if (strcmp(value, "memfd") == 0)
+            options.shmAllocator = SHM_ALLOC_MEMFD;
+        else if (strcmp(value, "posix") == 0)
+            options.shmAllocator = SHM_ALLOC_POSIX;
+        else
+            return false;
+    }
+    else if (name == "shm-pool")
+    {
+        if (strcmp(value, "shared") == 0)
+            options.shmSharedPool = true;
+        else if (strcmp(value, "per-buffer") == 0)
+            options.shmSharedPool = false;
+        else
+            return false;
+    }
+    else if (name == "dma-alloc")
+    {
+        if (strcmp(value, "gbm") == 0)
+            options.dmaAllocator = DMA_ALLOC_GBM;
+        else if (strcmp(value, "heap") == 0)
+            options.dmaAllocator = DMA_ALLOC_HEAP;
+        else if (strcmp(value, "udmabuf") == 0)
+            options.dmaAllocator = DMA_ALLOC_UDMABUF;
+        else
+            return false;
+    }
+    else if (name == "depth")
+    {
+        if (strcmp(value, "sweep") == 0)
+        {
+            options.depthSweep = true;
+            return true;
+        }
 
-    QSize squareSize(img.width() / slices, img.height() / slices);
+        options.depth = atoi(value);
 
-    painter.setPen(Qt::NoPen);
+        if (options.depth < 1 || options.depth > MAX_BUFFS)
+            return false;
+    }
+    else if (name == "prefault")
+    {
+        if (strcmp(value, "off") == 0)
+            options.prefault = PREFAULT_OFF;
+        else if (strcmp(value, "populate") == 0)
+            options.prefault = PREFAULT_POPULATE;
+        else if (strcmp(value, "touch") == 0)
+            options.prefault = PREFAULT_TOUCH;
+        else
+            return false;
+    }
+    else if (name == "drm-device")
+        options.drmDevice = value;
+    else if (name == "formats")
+    {
+        options.formats.clear();
 
-    painter.setCompositionMode(QPainter::CompositionMode_Source);
-    painter.setBrush(Qt::transparent);
+        if (strcmp(value, "all") == 0)
+        {
+            for (const PixelFormat &format : pixelFormats)
+                options.formats.push_back(&format);
 
-    painter.drawRect(0, 0, img.width(), img.height());
-    painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
+            return true;
+        }
 
-    for (int x = 0; x < slices; x++)
-    {
-        for (int y = 0; y < slices; y++)
+        std::string list = value;
+        size_t begin = 0;
+
+        while (begin <= list.size())
         {
-            painter.setBrush(QColor(rand() % 255, rand() % 255, rand() % 255, 200));
-            painter.drawRect(x * squareSize.width(),
-                             y * squareSize.height(),
-                             squareSize.width(),
-                             squareSize.height());
-        }
-    }
+            size_t end = list.find(',', begin);
 
-    painter.end();
+            if (end == std::string::npos)
+                end = list.size();
 
-    if (testingDMA)
-        dmaWriteEnd((DMABuffer*)buffer);
+            std::string item = list.substr(begin, end - begin);
+            const PixelFormat *match = NULL;
 
-    clock_gettime(CLOCK_MONOTONIC, &end_time);
-    elapsed_ns = (end_time.tv_sec - start_time.tv_sec) * 1000000000LL + (end_time.tv_nsec - start_time.tv_nsec);
+            for (const PixelFormat &format : pixelFormats)
+                if (item == format.option)
+                    match = &format;
 
-    nanos += elapsed_ns;
-    writes++;
-}
+            if (!match)
+                return false;
 
-static void renderTestDraw()
-{
-    if (testingDMA)
+            options.formats.push_back(match);
+            begin = end + 1;
+        }
+    }
+    else if (name == "shm-pages")
     {
-        render(toplevel->buffers[toplevel->i]);
-        Buffer *buffer = toplevel->buffers[prev(toplevel->i, BUFFS)];
-        toplevel->pendingCallback = true;
-        wl_callback *callback = wl_surface_frame(toplevel->surface);
-        wl_callback_add_listener(callback, &wl_callback_listener, buffer);
-        wl_surface_attach(toplevel->surface, buffer->buffer, 0, 0);
-        wl_surface_damage(toplevel->surface, 0, 0, buffer->width, buffer->height);
-        wl_surface_commit(toplevel->surface);
-        buffer->realeased = false;
-        buffer->commited = true;
-        buffer->callbacked = false;
-        toplevel->i = next(toplevel->i, BUFFS);
-        return;
+        if (strcmp(value, "hugetlb") == 0)
+            options.shmPages = SHM_PAGES_HUGETLB;
+        else if (strcmp(value, "thp") == 0)
+            options.shmPages = SHM_PAGES_THP;
+        else if (strcmp(value, "default") == 0)
+            options.shmPages = SHM_PAGES_DEFAULT;
+        else
+            return false;
     }
+    else if (name == "dma-create")
+    {
+        if (strcmp(value, "roundtrip") == 0)
+            options.dmaCreate = DMA_CREATE_ROUNDTRIP;
+        else if (strcmp(value, "batch") == 0)
+            options.dmaCreate = DMA_CREATE_BATCH;
+        else if (strcmp(value, "async") == 0)
+            options.dmaCreate = DMA_CREATE_ASYNC;
+        else
+            return false;
+    }
+    else if (name == "render-context")
+    {
+        if (strcmp(value, "frame") == 0)
+            options.persistentContext = false;
+        else if (strcmp(value, "persistent") == 0)
+            options.persistentContext = true;
+        else
+            return false;
+    }
+    else if (name == "shm-stride-align")
+    {
+        options.shmStrideAlign = atoi(value);
 
-    Buffer *buffer = toplevel->buffers[0];
-
-    if (buffer->realeased && buffer->commited)
+        if (options.shmStrideAlign != 64 && options.shmStrideAlign != 256 && options.shmStrideAlign != 4096)
+            return false;
+    }
+    else if (name == "shm-stride-pad")
     {
-        render(buffer);
-        buffer->commited = false;
+        options.shmStridePad = atoi(value);
 
-        if (toplevel->pendingCallback)
-            return;
+        // Rows must stay a whole number of pixels in every format
+        if (options.shmStridePad < 0 || options.shmStridePad % 8)
+            return false;
+    }
+    else if (name == "stride-sweep")
+    {
+        if (strcmp(value, "on") == 0)
+            options.strideSweep = true;
+        else if (strcmp(value, "off") == 0)
+            options.strideSweep = false;
+        else
+            return false;
+    }
+    else if (name == "render-target")
+    {
+        if (strcmp(value, "direct") == 0)
+            options.renderTarget = RENDER_DIRECT;
+        else if (strcmp(value, "shadow") == 0)
+            options.renderTarget = RENDER_SHADOW;
+        else if (strcmp(value, "auto") == 0)
+            options.renderTarget = RENDER_AUTO;
+        else
+            return false;
+    }
+    else if (name == "numa-memory")
+    {
+        options.numaMemory = atoi(value);
+        std::vector<int> nodes = numa_nodes();
 
-        toplevel->pendingCallback = true;
-        wl_callback *callback = wl_surface_frame(toplevel->surface);
-        wl_callback_add_listener(callback, &wl_callback_listener, buffer);
-        wl_surface_attach(toplevel->surface, buffer->buffer, 0, 0);
-        wl_surface_damage(toplevel->surface, 0, 0, buffer->width, buffer->height);
-        wl_surface_commit(toplevel->surface);
-        buffer->realeased = false;
-        buffer->commited = true;
-        buffer->callbacked = false;
+        // Any node the system has, masks are sized from the node
+        if (std::find(nodes.begin(), nodes.end(), options.numaMemory) == nodes.end())
+            return false;
     }
+    else if (name == "numa-cpu")
+    {
+        options.numaCpu = atoi(value);
 
-/*
-    // Check if there is a non commited buffer
-    for (int i = 0; i < 1; i++)
+        if (options.numaCpu < 0)
+            return false;
+    }
+    else if (name == "numa-compare")
     {
-        if (!toplevel->pendingCallback && !toplevel->buffers[i]->commited)
+        if (strcmp(value, "on") == 0)
+            options.numaCompare = true;
+        else if (strcmp(value, "off") == 0)
+            options.numaCompare = false;
+        else
+            return false;
+    }
+    else if (name == "render-threads")
+    {
+        if (strcmp(value, "sweep") == 0)
+            options.threadSweep = true;
+        else
         {
-            qDebug() << "SEND ALREADY RENDERED BUFF" << i;
+            options.renderThreads = atoi(value);
 
-            toplevel->pendingCallback = true;
-            wl_callback *callback = wl_surface_frame(toplevel->surface);
-            wl_callback_add_listener(callback, &wl_callback_listener,  toplevel->buffers[i]);
-            wl_surface_attach(toplevel->surface, toplevel->buffers[i]->buffer, 0, 0);
-            wl_surface_damage(toplevel->surface, 0, 0, toplevel->buffers[i]->width, toplevel->buffers[i]->height);
-            wl_surface_commit(toplevel->surface);
-            toplevel->buffers[i]->realeased = false;
-            toplevel->buffers[i]->commited = true;
-            toplevel->buffers[i]->callbacked = false;
-            break;
+            if (options.renderThreads < 1)
+                return false;
         }
     }
-
-    Buffer *buffer = nullptr;
-    int index = -1;
-
-    // Find a free buffer
-    for (int i = 0; i < 1; i++)
+    else if (name == "renderer")
     {
-        if (toplevel->buffers[i]->commited && toplevel->buffers[i]->callbacked && toplevel->buffers[i]->realeased)
+        if (strcmp(value, "qpainter") == 0)
+            options.kernelRenderer = false;
+        else if (strcmp(value, "kernels") == 0)
+            options.kernelRenderer = true;
+        else
+            return false;
+    }
+    else if (name == "kernel-isa")
+    {
+        if (strcmp(value, "auto") == 0)
+            options.blendIsa = BLEND_ISA_AUTO;
+        else if (strcmp(value, "avx2") == 0)
+            options.blendIsa = BLEND_ISA_AVX2;
+        else if (strcmp(value, "sse4.1") == 0)
+            options.blendIsa = BLEND_ISA_SSE41;
+        else if (strcmp(value, "scalar") == 0)
+            options.blendIsa = BLEND_ISA_SCALAR;
+        else
+            return false;
+    }
+    else if (name == "alpha")
+    {
+        if (strcmp(value, "straight") == 0)
+            options.premultiplied = false;
+        else if (strcmp(value, "premultiplied") == 0)
+            options.premultiplied = true;
+        else if (strcmp(value, "compare") == 0)
+            options.alphaCompare = true;
+        else
+            return false;
+    }
+    else if (name == "submit")
+    {
+        if (strcmp(value, "per-call") == 0)
+            options.batchRects = false;
+        else if (strcmp(value, "batched") == 0)
+            options.batchRects = true;
+        else
+            return false;
+    }
+    else if (name == "display-list")
+    {
+        if (strcmp(value, "on") == 0)
+            options.displayList = true;
+        else if (strcmp(value, "off") == 0)
+            options.displayList = false;
+        else
+            return false;
+    }
+    else if (name == "damage")
+    {
+        if (strcmp(value, "full") == 0)
+            options.damageFraction = 1.0;
+        else if (strcmp(value, "sweep") == 0)
+            options.damageSweep = true;
+        else
         {
-            index = i;
-            buffer = toplevel->buffers[i];
-            break;
+            options.damageFraction = atof(value);
+
+            if (options.damageFraction <= 0.0 || options.damageFraction > 1.0)
+                return false;
         }
     }
+    else if (name == "repair")
+    {
+        if (strcmp(value, "copy") == 0)
+            options.repairCopy = true;
+        else if (strcmp(value, "render") == 0)
+            options.repairCopy = false;
+        else
+            return false;
+    }
+    else if (name == "resize")
+    {
+        if (strcmp(value, "follow") == 0)
+            options.followConfigure = true;
+        else if (strcmp(value, "fixed") == 0)
+            options.followConfigure = false;
+        else
+            return false;
+    }
+    else if (name == "resize-storm")
+    {
+        options.resizeStormSteps = atoi(value);
 
-    // If no buffer free buffer, wait for frame callback or buffer release
-    if (!buffer)
-        return;
-
-    qDebug() << "RENDER" << index;
+        if (options.resizeStormSteps < 1)
+            return false;
+    }
+    else
+        return false;
 
+    return true;
+}
 
+int main(int argc, char *argv[])
+{
+    // Text needs the font database of a QGuiApplication, the Wayland connection stays our own
+    if (!qEnvironmentVariableIsSet("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
 
-    buffer->commited = false;
+    QGuiApplication app(argc, argv);
 
-    if (toplevel->pendingCallback)
+    if (argc < 5)
     {
-        renderTestDraw();
-        return;
+        qFatal() << "Run example: ./benchmark compositorName bufferWidth bufferHeight bufferScale [options]\n"
+                    "Options:\n"
+                    "  --shm-alloc=memfd|posix    SHM backing file (default memfd)\n"
+                    "  --shm-pool=shared|per-buffer    One wl_shm_pool for the swapchain or one per buffer (default shared)\n"
+                    "  --shm-pages=hugetlb|thp    Back the SHM swapchain and an extra SHM-HUGE column with 2 MiB pages\n"
+                    "  --dma-alloc=gbm|heap|udmabuf    DMA buffers from GBM, /dev/dma_heap/system or /dev/udmabuf (default gbm)\n"
+                    "  --dma-create=roundtrip|batch|async    Roundtrip after each DMA wl_buffer, or sync once after create_immed or create for all (default roundtrip)\n"
+                    "  --drm-device=PATH|vgem    DRM node used by the GBM allocator instead of the wl_drm one\n"
+                    "  --depth=1..8|sweep    Swapchain depth of the rendering tests, or every depth in turn (default 3)\n"
+                    "  --formats=LIST|all    Comma separated argb8888,xrgb8888,rgb565,argb2101010,fp16, the first one is used by the swapchain (default argb8888)\n"
+                    "  --prefault=off|populate|touch    Fault in buffer pages at creation with MAP_POPULATE or a write per page (default off)\n"
+                    "  --render-context=frame|persistent    New QImage and QPainter for every frame or one kept per buffer (default frame)\n"
+                    "  --shm-stride-align=64|256|4096    Align SHM rows to this many bytes (default packed)\n"
+                    "  --shm-stride-pad=BYTES    Extra bytes after each aligned SHM row, multiple of 8 (default 0)\n"
+                    "  --stride-sweep=on|off    Measure translucent row and column fills at widths 1000, 1024 and 2048 for several SHM row layouts\n"
+                    "  --render-target=direct|shadow|auto    Paint into the mapping, or into a cached shadow streamed to it, or pick per buffer type from the mapping probe (default direct)\n"
+                    "  --numa-memory=NODE    Bind SHM buffer memory to this NUMA node with mbind()\n"
+                    "  --numa-cpu=NODE    Run the rendering thread on the CPUs of this NUMA node\n"
+                    "  --numa-compare=on|off    Run every drawTest on SHM buffers on the rendering thread's node and on a remote one\n"
+                    "  --render-threads=N|sweep    Paint render() in N horizontal bands on N threads, or run the rendering tests from 1 thread to one per core (default 1)\n"
+                    "  --renderer=qpainter|kernels    Draw the rendering test frames with QPainter or with the blend kernels (default qpainter)\n"
+                    "  --kernel-isa=auto|avx2|sse4.1|scalar    Blend kernels to use, falling back to what the CPU supports (default auto)\n"
+                    "  --alpha=straight|premultiplied|compare    QImage formats with straight or premultiplied alpha, or every test in both (default straight)\n"
+                    "  --submit=per-call|batched    One setBrush() and drawRect() per rect, or rects grouped by color and drawn with drawRects() (default per-call)\n"
+                    "  --display-list=on|off    Record each rendering test frame into a display list, then replay it, timing both (default off)\n"
+                    "  --damage=full|FRACTION|sweep    Share of the render() cells changed and damaged per frame, for example 0.05, or 1 down to 0.01 in turn (default full)\n"
+                    "  --repair=render|copy    Partial damage repairs the cells a reused buffer missed by painting them again or copying them from the newest buffer (default render)\n"
+                    "  --resize=fixed|follow    Keep the requested buffer size or reallocate the swapchain on each toplevel configure (default fixed)\n"
+                    "  --resize-storm=N    After the rendering tests resize the SHM and then the DMA swapchain on every one of N frames";
+        exit(0);
     }
 
-    qDebug() << "SEND BUFF" << index;
-
-    toplevel->pendingCallback = true;
-    wl_callback *callback = wl_surface_frame(toplevel->surface);
-    wl_callback_add_listener(callback, &wl_callback_listener, buffer);
-    wl_surface_attach(toplevel->surface, buffer->buffer, 0, 0);
-    wl_surface_damage(toplevel->surface, 0, 0, buffer->width, buffer->height);
-    wl_surface_commit(toplevel->surface);
-    buffer->realeased = false;
-    buffer->commited = true;
-    buffer->callbacked = false;
-
-    // If DMA, try to render next frame immediatly
-    if (testingDMA)
-        renderTestDraw();
-*/
-}
-
-static void wl_buffer_handle_release(void *, wl_buffer *buff)
-{
-    Buffer *buffer = (Buffer*)wl_buffer_get_user_data(buff);
-    buffer->realeased = true;
+    for (int i = 5; i < argc; i++)
+    {
+        if (!parseOption(argv[i]))
+        {
+            qFatal() << "Invalid option" << argv[i];
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    if (!testingDMA)
-        renderTestDraw();
-}
+    if (options.formats.empty())
+        options.formats.push_back(&pixelFormats[0]);
 
-static void renderTestSHMBegin()
-{
-    qDebug() << "SHM Rendering Test:";
-    writes = 0;
-    testingDMA = false;
-    renderedFrames = 0;
-    nanos = 0;
-    toplevel->buffers = shmBuffers;
-    clock_gettime(CLOCK_MONOTONIC, &renderStart);
-    renderTestDraw();
-}
+    // Replay is single threaded, records one drawRect() per rect and always draws whole frames
+    if (options.displayList && (options.batchRects || options.renderThreads != 1 || options.threadSweep || options.damageSweep || options.damageFraction < 1.0))
+    {
+        qFatal() << "--display-list=on cannot be combined with --submit=batched, --render-threads or --damage";
+        exit(EXIT_FAILURE);
+    }
 
-static void renderTestDMABegin()
-{
-    qDebug() << "DMA Rendering Test:";
-    writes = 0;
-    testingDMA = true;
-    renderedFrames = 0;
-    nanos = 0;
-    toplevel->buffers = dmaBuffers;
-    clock_gettime(CLOCK_MONOTONIC, &renderStart);
-    Buffer *buffer = toplevel->buffers[0];
-    render(buffer);
-    toplevel->i = 1;
-    renderTestDraw();
-}
+    // Partial frames repaint cell by cell with QPainter on the rendering thread
+    bool partialDamage = options.damageSweep || options.damageFraction < 1.0;
 
-int main(int argc, char *argv[])
-{
-    QCoreApplication app(argc, argv);
+    if (partialDamage && (options.batchRects || options.kernelRenderer || options.renderThreads != 1 || options.threadSweep))
+    {
+        qFatal() << "--damage below 1 cannot be combined with --submit=batched, --renderer=kernels or --render-threads";
+        exit(EXIT_FAILURE);
+    }
 
-    if (argc < 4)
+    // The kernels draw whole frames on the rendering thread
+    if (options.kernelRenderer && (options.renderThreads != 1 || options.threadSweep))
     {
-        qFatal() << "Run example: ./benchmark compositorName bufferWidth bufferHeight bufferScale";
-        exit(0);
+        qFatal() << "--renderer=kernels cannot be combined with --render-threads";
+        exit(EXIT_FAILURE);
     }
 
     qDebug() << "Compositor:" << argv[1];
@@ -871,6 +4097,12 @@ int main(int argc, char *argv[])
     height = atoi(argv[3]);
     bufferScale = atoi(argv[4]);
 
+    blend_select(options.blendIsa);
+
+    // Before any buffer is faulted in from this thread
+    if (options.numaCpu >= 0)
+        bind_thread_to_node(options.numaCpu);
+
     display = wl_display_connect(NULL);
 
     if (!display)
@@ -885,73 +4117,269 @@ int main(int argc, char *argv[])
     wl_display_roundtrip(display);
     wl_display_roundtrip(display);
 
-    if (shm == NULL || compositor == NULL || wm_base == NULL)
+    if (shm == NULL || compositor == NULL || wm_base == NULL || linux_dmabuf == NULL)
     {
         qFatal() << "Missing Wayland Server globals";
         exit(EXIT_FAILURE);
     }
 
+    if (zwp_linux_dmabuf_v1_get_version(linux_dmabuf) >= ZWP_LINUX_DMABUF_V1_GET_DEFAULT_FEEDBACK_SINCE_VERSION)
+    {
+        defaultFeedback = dmabuf_feedback_create(zwp_linux_dmabuf_v1_get_default_feedback(linux_dmabuf), "default");
+        defaultFeedback->changed = &handle_feedback_changed;
+
+        while (!defaultFeedback->done)
+            wl_display_roundtrip(display);
+    }
+
+    const PixelFormat *format = options.formats[0];
+
+    if (!shm_format_supported(format) || !dma_format_supported(format))
+    {
+        qFatal() << "Swapchain format" << format->name << "not supported by the compositor";
+        exit(EXIT_FAILURE);
+    }
+
     // Create buffers
-    for (int i = 0; i < BUFFS; i++)
+    switch (options.dmaAllocator)
     {
-        shmBuffers[i] = create_shm_buffer(width, height);
-        shmBuffers[i]->i =  i;
-        dmaBuffers[i] = create_dma_buffer(width, height);
+    case DMA_ALLOC_GBM:
+        if (options.drmDevice)
+        {
+            std::string device = options.drmDevice;
+
+            if (device[0] != '/')
+                device = find_drm_device(options.drmDevice);
+
+            if (device.empty())
+            {
+                qFatal() << "No DRM device with driver" << options.drmDevice;
+                exit(EXIT_FAILURE);
+            }
+
+            wl_drm_handle_device(NULL, NULL, device.c_str());
+        }
+        else if (dma.drm < 0)
+        {
+            qFatal() << "Missing wl_drm global, try --dma-alloc=heap";
+            exit(EXIT_FAILURE);
+        }
+        break;
+    case DMA_ALLOC_HEAP:
+        dma.heap = open("/dev/dma_heap/system", O_RDONLY | O_CLOEXEC);
+
+        if (dma.heap < 0)
+        {
+            qFatal() << "Failed to open /dev/dma_heap/system";
+            exit(EXIT_FAILURE);
+        }
+        break;
+    case DMA_ALLOC_UDMABUF:
+        dma.udmabuf = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+
+        if (dma.udmabuf < 0)
+        {
+            qFatal() << "Failed to open /dev/udmabuf";
+            exit(EXIT_FAILURE);
+        }
+        break;
+    }
+
+    struct timespec start_time, end_time;
+    long long allocation_ns = 0;
+    buffCount = options.depthSweep ? MAX_BUFFS : options.depth;
+
+    // udmabuf buffers bring their own SHM view of the same pages
+    if (options.dmaAllocator != DMA_ALLOC_UDMABUF)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+        // Huge pages need files of their own, so they override the shared pool
+        if (options.shmSharedPool && options.shmPages == SHM_PAGES_DEFAULT)
+            shmPool = create_shm_pool(((shm_stride(width, format) * height + 4095) & ~4095) * buffCount);
+
+        for (int i = 0; i < buffCount; i++)
+        {
+            shmBuffers[i] = shmPool ? create_shm_pool_buffer(shmPool, width, height, format) : create_shm_buffer(width, height, format, options.shmPages);
+            shmBuffers[i]->i =  i;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end_time);
+        allocation_ns = (end_time.tv_sec - start_time.tv_sec) * 1000000000LL + (end_time.tv_nsec - start_time.tv_nsec);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    for (int i = 0; i < buffCount; i++)
+    {
+        dmaBuffers[i] = create_selected_dma_buffer(width, height, format, &shmBuffers[i]);
         dmaBuffers[i]->i =  i;
+        shmBuffers[i]->i =  i;
     }
 
-    wl_display_roundtrip(display);
-    wl_display_roundtrip(display);
+    wait_dma_buffers();
 
-    qDebug("Buffer size: %dx%d", width, height);
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    long long dma_allocation_ns = (end_time.tv_sec - start_time.tv_sec) * 1000000000LL + (end_time.tv_nsec - start_time.tv_nsec);
 
-    drawTest1(false, shmBuffers[0],100);
-    drawTest1(true, dmaBuffers[0], 100);
+    qDebug("Buffer size: %dx%d", width, height);
+    qDebug("SHM allocator: %s", options.dmaAllocator == DMA_ALLOC_UDMABUF ? "udmabuf memfd" : shm_allocator_name(options.shmAllocator));
+    qDebug("DMA allocator: %s", dma_allocator_name(options.dmaAllocator));
 
-    drawTest2(false, shmBuffers[0], 100);
-    drawTest2(true, dmaBuffers[0], 100);
+    if (options.renderThreads > 1)
+        qDebug("Rendering threads: %d", options.renderThreads);
 
-    drawTest1(false, shmBuffers[0], 10);
-    drawTest1(true, dmaBuffers[0], 10);
-    drawTest2(false, shmBuffers[0], 10);
-    drawTest2(true, dmaBuffers[0], 10);
+    qDebug("Blend kernels: %s", blend_isa_name());
+    qDebug("QImage alpha: %s", options.alphaCompare ? "straight and premultiplied" : options.premultiplied ? "premultiplied" : "straight");
 
-    drawTest1(false, shmBuffers[0], 1);
-    drawTest1(true, dmaBuffers[0], 1);
-    drawTest2(false, shmBuffers[0], 1);
-    drawTest2(true, dmaBuffers[0], 1);
+    if (options.numaMemory >= 0)
+        qDebug("SHM memory NUMA node: %d", options.numaMemory);
 
-    drawTest3(false, shmBuffers[0]);
-    drawTest3(true, dmaBuffers[0]);
+    if (options.numaCpu >= 0)
+        qDebug("Rendering thread NUMA node: %d", options.numaCpu);
 
-    drawTest4(false, shmBuffers[0]);
-    drawTest4(true, dmaBuffers[0]);
+    if (options.dmaAllocator != DMA_ALLOC_UDMABUF)
+        qDebug() << "SHM swapchain allocation" << (shmPool ? "(shared pool):" : "(per-buffer pools):") << allocation_ns << "nanoseconds";
 
-    createToplevel();
+    qDebug() << "DMA swapchain allocation (" << dma_create_name(options.dmaCreate) << "):" << dma_allocation_ns << "nanoseconds";
 
-    usleep(1000000);
+    if (options.shmPages != SHM_PAGES_DEFAULT)
+        qDebug("SHM-HUGE pages: %s", shm_page_size_name(options.shmPages));
 
-    renderTestSHMBegin();
+    probe_mapping(shmBuffers[0]);
+    probe_mapping(dmaBuffers[0]);
 
-    while (wl_display_dispatch(display) != -1)
+    for (const PixelFormat *testFormat : options.formats)
     {
-        if (benchFinished)
+        Buffer *shmColumn = NULL;
+        Buffer *hugeColumn = NULL;
+        Buffer *dmaColumn = NULL;
+        std::vector<Buffer*> owned;
+
+        bool shmSupported = shm_format_supported(testFormat);
+        bool dmaSupported = dma_format_supported(testFormat);
+
+        // A huge page swapchain stands in for the huge column, the 4K baseline gets a buffer of its own
+        bool hugeSwapchain = options.shmPages != SHM_PAGES_DEFAULT && options.dmaAllocator != DMA_ALLOC_UDMABUF;
+
+        if (testFormat == format)
         {
-            benchFinished = false;
-            break;
+            dmaColumn = dmaBuffers[0];
+
+            if (hugeSwapchain)
+            {
+                hugeColumn = shmBuffers[0];
+                shmColumn = create_shm_buffer(width, height, testFormat);
+                owned.push_back(shmColumn);
+            }
+            else
+                shmColumn = shmBuffers[0];
+        }
+        else
+        {
+            // The udmabuf SHM view can only exist along with its dmabuf
+            if (options.dmaAllocator == DMA_ALLOC_UDMABUF)
+                shmSupported = dmaSupported = shmSupported && dmaSupported;
+
+            if (dmaSupported)
+            {
+                dmaColumn = create_selected_dma_buffer(width, height, testFormat, &shmColumn);
+                owned.push_back(dmaColumn);
+
+                // With async creation the wl_buffer comes later
+                wait_dma_buffers();
+            }
+
+            if (shmSupported && !shmColumn)
+            {
+                shmColumn = create_shm_buffer(width, height, testFormat);
+                owned.push_back(shmColumn);
+            }
         }
+
+        if (shmSupported && options.shmPages != SHM_PAGES_DEFAULT && !hugeColumn)
+        {
+            hugeColumn = create_shm_buffer(width, height, testFormat, options.shmPages);
+            owned.push_back(hugeColumn);
+        }
+
+        if (!shmSupported)
+            qDebug("Format %s: not supported by wl_shm", testFormat->name);
+
+        if (!dmaSupported)
+            qDebug("Format %s: not supported by linux-dmabuf", testFormat->name);
+
+        std::vector<Buffer*> columns;
+
+        for (Buffer *buffer : {shmColumn, hugeColumn, dmaColumn})
+            if (buffer)
+                columns.push_back(buffer);
+
+        for (bool premultiplied : alpha_modes())
+        {
+            set_premultiplied(premultiplied, columns);
+            runDrawTests(columns);
+        }
+
+        for (Buffer *buffer : owned)
+            destroy_buffer(buffer);
     }
 
-    usleep(1000000);
+    if (options.strideSweep)
+        runStrideSweep(format);
 
-    renderTestDMABegin();
+    if (options.numaCompare)
+        runNumaCompare(format);
 
-    while (wl_display_dispatch(display) != -1)
+    createToplevel();
+    set_render_threads(options.renderThreads);
+    runStartupTest();
+
+    if (options.depthSweep)
     {
-        if (benchFinished)
+        for (int depth = 1; depth <= MAX_BUFFS; depth++)
         {
-            benchFinished = false;
-            break;
+            qDebug() << "Swapchain depth:" << depth;
+            toplevel->depth = depth;
+            runRenderTests();
+        }
+    }
+    else if (options.threadSweep)
+    {
+        qDebug() << "Swapchain depth:" << options.depth;
+        toplevel->depth = options.depth;
+        int cores = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<int> counts;
+
+        // Doubling up to the core count, which is always included
+        for (int threads = 1; threads < cores; threads *= 2)
+            counts.push_back(threads);
+
+        counts.push_back(cores);
+
+        for (int threads : counts)
+        {
+            qDebug() << "Rendering threads:" << threads;
+            set_render_threads(threads);
+            runRenderTests();
         }
+
+        set_render_threads(options.renderThreads);
+    }
+    else
+    {
+        qDebug() << "Swapchain depth:" << options.depth;
+        toplevel->depth = options.depth;
+        runRenderTests();
     }
+
+    if (options.resizeStormSteps)
+    {
+        runResizeStorm(false);
+        runResizeStorm(true);
+    }
+
+    // Every test drawing through render() is done
+    display_list_free(&frameList);
+    set_render_threads(1);
 }
@@ -1,10 +1,15 @@
-#define _POSIX_C_SOURCE 200809L
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <time.h>
 #include <unistd.h>
+#include <linux/memfd.h>
+
+#include "shm.h"
 
 /**
  * Boilerplate to create an in-memory shared file.
@@ -45,9 +50,34 @@ static int anonymous_shm_open(void)
 	return -1;
 }
 
-int create_shm_file(off_t size)
+static int anonymous_memfd_open(unsigned int flags)
+{
+    // Sealing must be allowed at creation, seals are added once the size is set
+    return memfd_create("hello-wayland", MFD_CLOEXEC | MFD_ALLOW_SEALING | flags);
+}
+
+off_t shm_file_size(off_t size, ShmPageSize pages)
 {
-	int fd = anonymous_shm_open();
+    if (pages == SHM_PAGES_DEFAULT)
+        return size;
+
+    return (size + SHM_HUGE_PAGE_SIZE - 1) & ~(off_t)(SHM_HUGE_PAGE_SIZE - 1);
+}
+
+int create_shm_file(off_t size, ShmAllocator allocator, ShmPageSize pages, bool growable)
+{
+    int fd;
+
+    // hugetlbfs files can only come from memfd_create()
+    if (pages == SHM_PAGES_HUGETLB)
+    {
+        allocator = SHM_ALLOC_MEMFD;
+        fd = anonymous_memfd_open(MFD_HUGETLB | MFD_HUGE_2MB);
+    }
+    else if (allocator == SHM_ALLOC_MEMFD)
+        fd = anonymous_memfd_open(0);
+    else
+        fd = anonymous_shm_open();
 
     if (fd < 0)
     {
@@ -60,5 +90,41 @@ int create_shm_file(off_t size)
 		return -1;
 	}
 
+    /* A file that can not shrink can not SIGBUS the compositor, so it may map
+     * it without installing its own fault handler */
+    if (allocator == SHM_ALLOC_MEMFD && fcntl(fd, F_ADD_SEALS, growable ? F_SEAL_SHRINK : F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
 	return fd;
 }
+
+const char *shm_allocator_name(ShmAllocator allocator)
+{
+    switch (allocator)
+    {
+    case SHM_ALLOC_POSIX:
+        return "shm_open";
+    case SHM_ALLOC_MEMFD:
+        return "memfd (sealed)";
+    }
+
+    return "unknown";
+}
+
+const char *shm_page_size_name(ShmPageSize pages)
+{
+    switch (pages)
+    {
+    case SHM_PAGES_DEFAULT:
+        return "4 KiB";
+    case SHM_PAGES_HUGETLB:
+        return "2 MiB hugetlb";
+    case SHM_PAGES_THP:
+        return "2 MiB transparent (madvise)";
+    }
+
+    return "unknown";
+}
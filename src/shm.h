@@ -3,6 +3,27 @@
 
 #include <sys/types.h>
 
-int create_shm_file(off_t size);
+enum ShmAllocator
+{
+    SHM_ALLOC_POSIX,    // shm_open() with a random name, unlinked right away
+    SHM_ALLOC_MEMFD     // memfd_create() sealed with F_SEAL_SHRINK | F_SEAL_GROW
+};
+
+enum ShmPageSize
+{
+    SHM_PAGES_DEFAULT,  // Regular 4 KiB shmem pages
+    SHM_PAGES_HUGETLB,  // memfd_create() with MFD_HUGETLB | MFD_HUGE_2MB, needs reserved hugepages
+    SHM_PAGES_THP       // Regular shmem, the mapping is madvised with MADV_HUGEPAGE
+};
+
+#define SHM_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Size to pass to create_shm_file() and mmap(), rounded up to whole huge pages if needed
+off_t shm_file_size(off_t size, ShmPageSize pages);
+
+// Growable files are only sealed against shrinking
+int create_shm_file(off_t size, ShmAllocator allocator = SHM_ALLOC_MEMFD, ShmPageSize pages = SHM_PAGES_DEFAULT, bool growable = false);
+const char *shm_allocator_name(ShmAllocator allocator);
+const char *shm_page_size_name(ShmPageSize pages);
 
 #endif